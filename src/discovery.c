@@ -0,0 +1,171 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "discovery.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(discovery);
+
+#define ADDRESS_LENGTH 5
+#define PCF_BITS 9
+#define CRC_BITS 16
+
+static struct {
+    uint8_t address[ADDRESS_LENGTH];
+    uint16_t hits;
+} candidates[DISCOVERY_MAX_CANDIDATES];
+static int candidates_count;
+
+// The results are read from the USB stack context
+static struct k_spinlock candidates_lock;
+
+static inline int get_bit(const uint8_t *data, int bit)
+{
+    return (data[bit / 8] >> (7 - (bit % 8))) & 0x01;
+}
+
+static uint16_t get_bits16(const uint8_t *data, int first_bit)
+{
+    uint16_t value = 0;
+    for (int i = 0; i < 16; i++) {
+        value = (value << 1) | get_bit(data, first_bit + i);
+    }
+    return value;
+}
+
+// ESB CRC: CRC16-CCITT, initial value 0xffff, over the address, PCF and payload bits
+static uint16_t crc16_bits(const uint8_t *data, int bits)
+{
+    uint16_t crc = 0xffff;
+
+    for (int i = 0; i < bits; i++) {
+        bool msb = ((crc >> 15) & 0x01) ^ get_bit(data, i);
+        crc <<= 1;
+        if (msb) {
+            crc ^= 0x1021;
+        }
+    }
+
+    return crc;
+}
+
+// A frame is a valid packet if the PCF length is valid and the CRC following the payload matches
+static bool frame_is_valid(const uint8_t *frame, int frame_length)
+{
+    int payload_length = frame[ADDRESS_LENGTH] >> 2;
+    int crc_bit = (ADDRESS_LENGTH * 8) + PCF_BITS + (payload_length * 8);
+
+    if (payload_length > 32 || crc_bit + CRC_BITS > frame_length * 8) {
+        return false;
+    }
+
+    return crc16_bits(frame, crc_bit) == get_bits16(frame, crc_bit);
+}
+
+static void count_hit(const uint8_t *address)
+{
+    k_spinlock_key_t key = k_spin_lock(&candidates_lock);
+
+    int i;
+    for (i = 0; i < candidates_count; i++) {
+        if (memcmp(candidates[i].address, address, ADDRESS_LENGTH) == 0) {
+            break;
+        }
+    }
+
+    if (i == candidates_count) {
+        if (candidates_count < DISCOVERY_MAX_CANDIDATES) {
+            candidates_count += 1;
+        } else {
+            // Table full, replace the candidate with the least hits
+            i = 0;
+            for (int j = 1; j < candidates_count; j++) {
+                if (candidates[j].hits < candidates[i].hits) {
+                    i = j;
+                }
+            }
+        }
+        memcpy(candidates[i].address, address, ADDRESS_LENGTH);
+        candidates[i].hits = 0;
+    }
+
+    if (candidates[i].hits < UINT16_MAX) {
+        candidates[i].hits += 1;
+    }
+
+    k_spin_unlock(&candidates_lock, key);
+}
+
+void discovery_reset(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&candidates_lock);
+    candidates_count = 0;
+    k_spin_unlock(&candidates_lock, key);
+}
+
+void discovery_process(void)
+{
+    const struct esbSnifferRecord_s *record;
+
+    for (int i = 0; i < ESB_SNIFFER_RING_SIZE && (record = esb_sniffer_peek()) != NULL; i++) {
+        int frame_length = record->length - sizeof(struct esbSnifferRecord_s);
+
+        if (frame_is_valid(record->data, frame_length)) {
+            LOG_DBG("Valid packet from %02x%02x%02x%02x%02x", record->data[0], record->data[1],
+                    record->data[2], record->data[3], record->data[4]);
+            count_hit(record->data);
+        }
+
+        esb_sniffer_release();
+    }
+}
+
+int discovery_get_results(struct discoveryResult_s *results)
+{
+    k_spinlock_key_t key = k_spin_lock(&candidates_lock);
+
+    // Selection of the candidates with the most hits, the table is small
+    bool taken[DISCOVERY_MAX_CANDIDATES] = {false};
+    int count = MIN(candidates_count, DISCOVERY_MAX_RESULTS);
+
+    for (int n = 0; n < count; n++) {
+        int best = -1;
+        for (int i = 0; i < candidates_count; i++) {
+            if (!taken[i] && (best < 0 || candidates[i].hits > candidates[best].hits)) {
+                best = i;
+            }
+        }
+        taken[best] = true;
+        memcpy(results[n].address, candidates[best].address, ADDRESS_LENGTH);
+        results[n].hits = sys_cpu_to_le16(candidates[best].hits);
+    }
+
+    k_spin_unlock(&candidates_lock, key);
+
+    return count;
+}
@@ -0,0 +1,67 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esb.h"
+
+/**
+ * @brief Number of candidate addresses tracked during discovery
+ */
+#define DISCOVERY_MAX_CANDIDATES 16
+
+/**
+ * @brief Maximum number of candidates returned by discovery_get_results()
+ */
+#define DISCOVERY_MAX_RESULTS 8
+
+/**
+ * @brief Discovery result entry
+ */
+struct discoveryResult_s {
+    uint8_t address[5];
+    uint16_t hits;      // Number of valid packets received, saturates at 65535
+} __attribute__((packed));
+
+/**
+ * @brief Forget all candidate addresses
+ */
+void discovery_reset(void);
+
+/**
+ * @brief Validate the raw frames received in discovery mode and count the hits of their address
+ *
+ * Consumes all the records available from esb_sniffer_peek(). A frame is counted only if it
+ * contains a valid ESB packet with a 5 bytes address, checked with the packet CRC.
+ */
+void discovery_process(void);
+
+/**
+ * @brief Get the candidate addresses with the most hits
+ *
+ * @param results Array of at least DISCOVERY_MAX_RESULTS entries, sorted by hits
+ * @return Number of entries filled
+ */
+int discovery_get_results(struct discoveryResult_s *results);
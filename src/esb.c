@@ -42,58 +42,750 @@ LOG_MODULE_REGISTER(esb);
 
 static K_MUTEX_DEFINE(radio_busy);
 static K_SEM_DEFINE(radioXferDone, 0, 1);
+// Available when the TX queue is empty and the radio is not transmitting
+static K_SEM_DEFINE(txIdle, 1, 1);
+
+static void tx_watchdog_expired(struct k_timer *timer);
+static K_TIMER_DEFINE(txWatchdog, tx_watchdog_expired, NULL);
 
 static bool isInit = false;
 static bool sending;
 static bool timeout;
 static uint8_t pid = 0;
+static struct esbPacket_s * txPacket;
 static struct esbPacket_s * ackBuffer;
+static int arc_counter;
+static bool ack_received;
+
+// TX descriptor ring, the descriptor at txQueueTail is the one on air
+static struct {
+    struct esbTxDesc_s *desc;
+    esb_tx_cb_t cb;
+} txQueue[ESB_TX_QUEUE_DEPTH];
+static int txQueueHead;
+static int txQueueTail;
+static int txQueueCount;
 static bool ack_enabled = true;
 static int arc = 3;
+static uint8_t ard = ESB_ARD_DEFAULT;
+static esbBitrate_t bitrate = radioBitrate2M;
+static uint8_t channel = 42;
+static uint32_t ack_timeout_us;
 static int packet_loss_percent = 0;
 static int ack_loss_percent = 0;
 
 static bool continuous_carrier_enabled = false;
 
 static bool sniffer_active = false;
+static uint8_t sniffer_pipes = 0x03;
+// Discovery runs on top of sniffer mode, with raw frames instead of ESB packets
+static bool discovery_active = false;
+static struct {
+    uint32_t base0;
+    uint32_t base1;
+    uint32_t prefix0;
+    uint32_t prefix1;
+    uint8_t pipe0_address[5];
+} discovery_saved_addresses;
 static esb_sniffer_rx_cb_t sniffer_callback = NULL;
-static struct esbPacket_s sniffer_rx_buffer;
+static struct esbSnifferFilter_s sniffer_filter;
+static bool sniffer_filter_enabled = false;
+static bool sniffer_keep_crc_errors = false;
+// Last packet kept per pipe, used to drop retransmissions
+static struct {
+    bool valid;
+    uint8_t pid;
+    uint32_t crc;
+} sniffer_last[ESB_NUM_PIPES];
+// Sniffer RX stopped from thread context, to transmit or to stop the sniffer: the radio
+// interrupt only signals radioXferDone
+static bool sniffer_paused = false;
+// Sniffer channel hopping, the table is applied when the sniffer starts
+static struct {
+    uint8_t channels[ESB_HOP_MAX_CHANNELS];
+    int count;
+    uint32_t dwell_us;
+    uint8_t flags;
+} hop_table;
+static bool hop_active = false;
+static int hop_index;
+// TIMER0 time at which RX is stopped to hop to the next channel
+static uint32_t hop_deadline;
+// A dwell time ending sooner than that is handled as expired, COMPARE1 could be missed otherwise
+#define HOP_MIN_TIME_LEFT_US 10
 static uint8_t current_pipe0_address[5] = {0xe7, 0xe7, 0xe7, 0xe7, 0xe7};
+// Addresses of pipes 1 to 7, pipe 0 is current_pipe0_address
+static uint8_t pipe_addresses[ESB_NUM_PIPES][5];
+static uint8_t rx_pipes = 0x01;
+static uint8_t tx_pipe = 0;
+
+// Link statistics, updated from ISR when a packet sent with ack enabled completes
+static struct esbTargetStats_s target_stats[ESB_LINK_STATS_TARGETS];
+static int target_stats_count;
+static struct esbLinkStats_s channel_stats[ESB_LINK_STATS_CHANNELS];
+// The RSSI average moves by 1/2^LINK_STATS_RSSI_SHIFT of the difference with each ack
+#define LINK_STATS_RSSI_SHIFT 3
+
+// Receive ring used in sniffer and PRX modes. The radio receives in the slot at rxRingHead
+// and the records between rxRingTail and rxRingHead are waiting to be consumed. Each slot has
+// room in front of the radio packet to write the record header once the packet is received,
+// so that the record ends up contiguous with the received payload without any copy.
+// The headroom fits an extended record header, a normal record starts further in the slot.
+#define RX_RING_HEADROOM (sizeof(struct esbSnifferExtRecord_s) - offsetof(struct esbPacket_s, data))
+
+static struct {
+    uint8_t headroom[RX_RING_HEADROOM];
+    struct esbPacket_s packet;
+} __attribute__((packed)) rxRing[ESB_SNIFFER_RING_SIZE];
+static volatile int rxRingHead;
+static volatile int rxRingTail;
+static volatile uint32_t rx_drop_count;
+static bool extended_records = false;
+// Record format of the ring, latched from extended_records when the ring is reset
+static bool rx_extended_records;
+
+// PRX mode
+enum prx_state {
+    prx_state_rx,
+    prx_state_tx_ack,
+};
+
+static bool prx_active = false;
+static enum prx_state prx_state;
+static esb_sniffer_rx_cb_t prx_callback = NULL;
+static struct esbPacket_s prx_empty_ack;
+
+// Per-pipe ack payload FIFO. The packet at the tail is the one sent in acks until
+// a packet with a new PID is received on the pipe, which means that the ack went through.
+static struct {
+    struct esbPacket_s packets[ESB_ACK_PAYLOAD_QUEUE_DEPTH];
+    int head;
+    int tail;
+    int count;
+    bool in_flight;
+    // Last received packet, used to detect retransmissions
+    bool has_last;
+    uint8_t last_pid;
+    uint32_t last_crc;
+} ackFifo[ESB_NUM_PIPES];
 
 const nrfx_timer_t timer0 = NRFX_TIMER_INSTANCE(0);
 
-static void radio_isr(void *arg)
+// PPI channels allocated by esb_init(), freed by esb_deinit() so that the radio can be
+// initialized again: the timestamp capture and the radio event counters
+#define ESB_PPI_CHANNEL_COUNT 5
+static nrf_ppi_channel_t ppi_channels[ESB_PPI_CHANNEL_COUNT];
+static int ppi_channel_count;
+
+// 64 bits radio time: TIMER0 extended with the number of times it has wrapped, which is
+// updated each time the time is read. timeWrapTimer reads it often enough to not miss a wrap.
+static uint32_t time_wraps;
+static uint32_t time_last;
+#define TIME_WRAP_CHECK_PERIOD K_MINUTES(10)
+static void time_wrap_check(struct k_timer *timer);
+static K_TIMER_DEFINE(timeWrapTimer, time_wrap_check, NULL);
+
+// Connect an event to a task with a newly allocated PPI channel
+static bool ppi_connect(uint32_t event_address, uint32_t task_address)
 {
-    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
-    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+    nrf_ppi_channel_t ppi;
 
-    if (sniffer_active) {
-        bool crc_ok = nrf_radio_crc_status_check(NRF_RADIO);
+    if (ppi_channel_count >= ESB_PPI_CHANNEL_COUNT || nrfx_ppi_channel_alloc(&ppi) != NRFX_SUCCESS) {
+        return false;
+    }
 
-        if (crc_ok && sniffer_callback) {
-            static struct esbSnifferPacket_s pkt;
-            pkt.length = sniffer_rx_buffer.length;
-            if (pkt.length > ESB_MAX_PAYLOAD_LENGTH) {
-                pkt.length = ESB_MAX_PAYLOAD_LENGTH;
-            }
-            pkt.rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
-            pkt.pipe = nrf_radio_rxmatch_get(NRF_RADIO);
+    nrfx_ppi_channel_assign(ppi, event_address, task_address);
+    nrfx_ppi_channel_enable(ppi);
+    ppi_channels[ppi_channel_count++] = ppi;
+
+    return true;
+}
+
+static void ppi_release_all(void)
+{
+    for (int i = 0; i < ppi_channel_count; i++) {
+        nrfx_ppi_channel_disable(ppi_channels[i]);
+        nrfx_ppi_channel_free(ppi_channels[i]);
+    }
+    ppi_channel_count = 0;
+}
+
+// Count a radio event with a TIMER in counter mode, triggered by PPI so that it costs no interrupt
+static void radio_counter_init(NRF_TIMER_Type *timer, nrf_radio_event_t event)
+{
+    nrf_timer_mode_set(timer, NRF_TIMER_MODE_COUNTER);
+    nrf_timer_bit_width_set(timer, NRF_TIMER_BIT_WIDTH_32);
+    nrf_timer_task_trigger(timer, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(timer, NRF_TIMER_TASK_START);
+
+    if (!ppi_connect(nrf_radio_event_address_get(NRF_RADIO, event),
+                     nrf_timer_task_address_get(timer, NRF_TIMER_TASK_COUNT))) {
+        LOG_ERR("Cannot allocate a radio counter PPI channel");
+    }
+}
+
+static uint32_t radio_counter_get(NRF_TIMER_Type *timer)
+{
+    nrf_timer_task_trigger(timer, NRF_TIMER_TASK_CAPTURE0);
+    return nrf_timer_cc_get(timer, NRF_TIMER_CC_CHANNEL0);
+}
+
+static void radio_counters_reset(void)
+{
+    nrf_timer_task_trigger(NRF_TIMER1, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(NRF_TIMER2, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(NRF_TIMER3, NRF_TIMER_TASK_CLEAR);
+    nrf_timer_task_trigger(NRF_TIMER4, NRF_TIMER_TASK_CLEAR);
+}
+
+// TIMER0 time, captured in CC0 that is only used to read the time
+static uint32_t timer0_now(void)
+{
+    nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_CAPTURE0);
+    return nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL0);
+}
+
+// Time between the end of a packet and the start of the ack: RX ramp-up on our side
+// while the PRX disables and ramps up its TX
+#define ESB_ACK_TURNAROUND_US 150
+// Margin for timer resolution and clock inaccuracy
+#define ESB_ACK_TIMEOUT_MARGIN_US 50
+
+// On-air time of an ESB packet: preamble(1) + address(5) + PCF(9 bits) + payload + CRC(2)
+static uint32_t packet_airtime_us(int payload_length)
+{
+    uint32_t bits = 8 * (1 + 5 + payload_length + 2) + 9;
+
+    if (bitrate == radioBitrate2M) {
+        return (bits + 1) / 2;
+    } else {
+        return bits;
+    }
+}
+
+// The ack timeout is counted from the END of the transmitted packet and is also the ARD: a
+// failed attempt is retried as soon as it expires, so attempts are spaced as on the nRF24,
+// where ARD runs from the end of a packet to the start of the next one. In ack length mode
+// it covers a whole ack of that length, so that the next attempt never starts while the PRX
+// could still be sending its ack. It is disabled by hardware when the ack address is received:
+// an ack received with a CRC error is then retried as soon as it ends.
+static void update_ack_timeout(void)
+{
+    if (ard & ESB_ARD_ACK_LENGTH) {
+        int ack_length = MIN(ard & ~ESB_ARD_ACK_LENGTH, 32);
+        ack_timeout_us = ESB_ACK_TURNAROUND_US + packet_airtime_us(ack_length) + ESB_ACK_TIMEOUT_MARGIN_US;
+    } else {
+        ack_timeout_us = ((ard & 0x0f) + 1) * 250;
+    }
+}
+
+// Start one PTX attempt of txPacket. Called from thread context for the first
+// attempt and from the radio ISR for every retry, so that the whole ARC loop
+// runs without waking up the calling thread.
+static void ptx_start_attempt(void)
+{
+    nrf_radio_shorts_enable(NRF_RADIO, RADIO_SHORTS_READY_START_Msk |
+                                RADIO_SHORTS_END_DISABLE_Msk);
+    if (ack_enabled) {
+        nrf_radio_shorts_enable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
+    }
+    nrf_ppi_channel_enable(NRF_PPI, NRF_PPI_CHANNEL27); // END -> Timer0 Capture[2]
+    nrfx_ppi_channel_enable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1]  (debug)
+
+    nrf_radio_packetptr_set(NRF_RADIO, txPacket);
+    ackBuffer->length = 0;
+
+    // Enable FEM PA
+    fem_txen_set(true);
+
+    sending = true;
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+}
+
+// Start the descriptor at the tail of the TX queue, or release the radio if
+// the queue is empty. Called with interrupts locked or from ISR.
+static void tx_start_next(void)
+{
+    while (txQueueCount > 0) {
+        struct esbTxDesc_s *desc = txQueue[txQueueTail].desc;
+
+        if (desc->drop_packet) {
+            // Simulated packet loss, complete without touching the radio
+            desc->acked = false;
+            desc->rssi = 0;
+            desc->retry = 0;
+            esb_tx_cb_t cb = txQueue[txQueueTail].cb;
+            txQueueTail = (txQueueTail + 1) % ESB_TX_QUEUE_DEPTH;
+            txQueueCount -= 1;
+            cb(desc);
+            continue;
+        }
+
+        // Handling packet PID. S1 format is | PID(2) | ACK flag |
+        desc->packet->s1 = ((pid & 0x03)<<1) | 1;
+        pid++;
+
+        txPacket = desc->packet;
+        ackBuffer = desc->ack;
+        arc_counter = 0;
+        ack_received = false;
+
+        // Enable disabled interrupt only, the rest is handled by shorts
+        // and by the ISR that restarts the transmission until an ack is
+        // received or ARC is exhausted
+        nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+        nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+        k_timer_start(&txWatchdog, K_MSEC(200), K_NO_WAIT);
+        ptx_start_attempt();
+        return;
+    }
+
+    // We do not need the interrupt anymore
+    nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+    // Clean up after ourselves
+    nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_READY_START_Msk |
+                                RADIO_SHORTS_END_DISABLE_Msk |
+                                RADIO_SHORTS_DISABLED_RXEN_Msk);
+    nrf_ppi_channel_disable(NRF_PPI, NRF_PPI_CHANNEL27); // END -> Timer0 Capture[2]
+    nrfx_ppi_channel_disable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1]  (debug)
+
+    k_sem_give(&txIdle);
+}
+
+static void link_stats_update(struct esbLinkStats_s *link, bool acked, uint8_t rssi, uint32_t now)
+{
+    link->attempts += 1;
+    if (!acked) {
+        return;
+    }
+
+    link->acks += 1;
+    link->last_ack_us = now;
+    if (link->rssi_ewma == 0) {
+        link->rssi_ewma = rssi << 8;
+    } else {
+        link->rssi_ewma += ((int32_t)(rssi << 8) - link->rssi_ewma) >> LINK_STATS_RSSI_SHIFT;
+    }
+}
+
+// Entry of the current target. A new target replaces the one that has never acked, or else
+// the one that acked the longest ago.
+static struct esbTargetStats_s *link_stats_target(uint32_t now)
+{
+    const uint8_t *address = (tx_pipe == 0) ? current_pipe0_address : pipe_addresses[tx_pipe];
+    struct esbTargetStats_s *oldest = &target_stats[0];
+
+    for (int i = 0; i < target_stats_count; i++) {
+        struct esbTargetStats_s *entry = &target_stats[i];
+        if (memcmp(entry->address, address, 5) == 0) {
+            return entry;
+        }
+        if (oldest->link.acks != 0 &&
+            (entry->link.acks == 0 || (now - entry->link.last_ack_us) > (now - oldest->link.last_ack_us))) {
+            oldest = entry;
+        }
+    }
+
+    struct esbTargetStats_s *entry = oldest;
+    if (target_stats_count < ESB_LINK_STATS_TARGETS) {
+        entry = &target_stats[target_stats_count++];
+    }
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->address, address, 5);
+    return entry;
+}
+
+// Called from ISR
+static void link_stats_record(const struct esbTxDesc_s *desc)
+{
+    uint32_t now = timer0_now();
+    struct esbTargetStats_s *target = link_stats_target(now);
+
+    target->channel = channel;
+    link_stats_update(&target->link, desc->acked, desc->rssi, now);
+    if (desc->acked && target->retry_histogram[desc->retry & 0x0f] < UINT16_MAX) {
+        target->retry_histogram[desc->retry & 0x0f] += 1;
+    }
+
+    if (channel < ESB_LINK_STATS_CHANNELS) {
+        link_stats_update(&channel_stats[channel], desc->acked, desc->rssi, now);
+    }
+}
+
+// Report the result of the descriptor on air and start the next one
+static void tx_complete(void)
+{
+    struct esbTxDesc_s *desc = txQueue[txQueueTail].desc;
+    esb_tx_cb_t cb = txQueue[txQueueTail].cb;
+
+    k_timer_stop(&txWatchdog);
+
+    // If ack is not enabled, it is normal to not receive an ack
+    desc->acked = ack_received && ack_enabled && !desc->drop_ack;
+    desc->rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
+    desc->retry = arc_counter - 1;
+
+    // Without ack, nothing is known about the link
+    if (ack_enabled) {
+        link_stats_record(desc);
+    }
+
+    txQueueTail = (txQueueTail + 1) % ESB_TX_QUEUE_DEPTH;
+    txQueueCount -= 1;
+
+    cb(desc);
+
+    tx_start_next();
+}
+
+// Wait for all queued packets to be sent, must be called with radio_busy taken
+static void wait_tx_idle(void)
+{
+    k_sem_take(&txIdle, K_FOREVER);
+    k_sem_give(&txIdle);
+}
+
+static void rx_ring_reset(void)
+{
+    rxRingHead = 0;
+    rxRingTail = 0;
+    rx_drop_count = 0;
+    rx_extended_records = extended_records;
+}
+
+// Record of a slot, an extended record starts at the beginning of the headroom
+static void *rx_ring_record(int index)
+{
+    uint8_t *slot = (uint8_t *)&rxRing[index];
+
+    if (rx_extended_records) {
+        return slot;
+    }
+
+    return slot + sizeof(struct esbSnifferExtRecord_s) - sizeof(struct esbSnifferRecord_s);
+}
+
+// Radio buffer for the next reception
+static struct esbPacket_s *rx_ring_slot(void)
+{
+    return &rxRing[rxRingHead].packet;
+}
+
+// Turn the packet received in the head slot into a record and move the radio to the next
+// slot. Called from ISR, the packet is dropped and the slot reused if the ring is full.
+// The flags are only stored in extended records.
+static bool rx_ring_commit(uint8_t pipe, uint8_t flags)
+{
+    int next = (rxRingHead + 1) % ESB_SNIFFER_RING_SIZE;
+
+    if (next == rxRingTail) {
+        rx_drop_count += 1;
+        return false;
+    }
+
+    uint8_t length = MIN(rxRing[rxRingHead].packet.length, ESB_MAX_PAYLOAD_LENGTH);
+    uint8_t rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
+    // Latched by PPI when the address was received
+    uint32_t timestamp_us = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL3);
+
+    // The header overlaps the packet length and S1 fields, that must not be used after this
+    if (rx_extended_records) {
+        struct esbSnifferExtRecord_s *record = rx_ring_record(rxRingHead);
+        record->length = sizeof(struct esbSnifferExtRecord_s) + length;
+        record->rssi = rssi;
+        record->pipe = pipe;
+        record->timestamp_us = timestamp_us;
+        record->channel = hop_active ? hop_table.channels[hop_index] : channel;
+        record->flags = flags;
+    } else {
+        struct esbSnifferRecord_s *record = rx_ring_record(rxRingHead);
+        record->length = sizeof(struct esbSnifferRecord_s) + length;
+        record->rssi = rssi;
+        record->pipe = pipe;
+        record->timestamp_us = timestamp_us;
+    }
+
+    // The record must be complete before the consumer can see it
+    __DMB();
+    rxRingHead = next;
+
+    return true;
+}
 
-            // Software-capture timestamp from TIMER0
-            nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_CAPTURE3);
-            pkt.timestamp_us = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL3);
+// Evaluate the sniffer filter on the packet received in the head slot, called from ISR
+static bool sniffer_filter_accept(uint8_t pipe, bool crc_ok)
+{
+    if (!sniffer_filter_enabled) {
+        return true;
+    }
+
+    const struct esbPacket_s *packet = rx_ring_slot();
+
+    if (packet->length < sniffer_filter.min_length || packet->length > sniffer_filter.max_length) {
+        return false;
+    }
+
+    if ((sniffer_filter.pipe_mask & (1u << pipe)) == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < ESB_SNIFFER_FILTER_MATCH_LENGTH; i++) {
+        if (sniffer_filter.mask[i] == 0) {
+            continue;
+        }
+        if (i >= packet->length || (packet->data[i] & sniffer_filter.mask[i]) != sniffer_filter.match[i]) {
+            return false;
+        }
+    }
+
+    // The CRC of a corrupted packet does not identify it
+    if (sniffer_filter.drop_duplicates && crc_ok) {
+        uint8_t packet_pid = (packet->s1 >> 1) & 0x03;
+        uint32_t crc = nrf_radio_rxcrc_get(NRF_RADIO);
+        if (sniffer_last[pipe].valid && sniffer_last[pipe].pid == packet_pid && sniffer_last[pipe].crc == crc) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Remember the packet stored in the ring, so that its retransmissions are dropped. Only once it
+// is stored: a packet dropped because the ring is full is kept when it is retransmitted.
+static void sniffer_filter_stored(uint8_t pipe, uint8_t packet_pid)
+{
+    if (sniffer_filter_enabled && sniffer_filter.drop_duplicates) {
+        sniffer_last[pipe].valid = true;
+        sniffer_last[pipe].pid = packet_pid;
+        sniffer_last[pipe].crc = nrf_radio_rxcrc_get(NRF_RADIO);
+    }
+}
+
+#define SNIFFER_SHORTS (RADIO_SHORTS_READY_START_Msk | RADIO_SHORTS_END_DISABLE_Msk | \
+                        NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK | NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK)
+
+// Continuous RX shorts of sniffer mode. When hopping, RX is restarted by the ISR once the
+// radio has been retuned instead of by the DISABLED->RXEN short.
+static uint32_t sniffer_shorts(void)
+{
+    if (hop_active) {
+        return SNIFFER_SHORTS;
+    }
+
+    return SNIFFER_SHORTS | RADIO_SHORTS_DISABLED_RXEN_Msk;
+}
+
+// Start the dwell time on the current channel. As for the PTX ack timeout, RX is stopped by
+// COMPARE1 through PPI22 and the ADDRESS capture in CC1 through PPI26 moves the deadline out
+// of the way while a packet is received.
+static void hop_timer_start(void)
+{
+    if (hop_active && hop_table.dwell_us > 0) {
+        hop_deadline = timer0_now() + hop_table.dwell_us;
+        nrf_timer_event_clear(NRF_TIMER0, NRF_TIMER_EVENT_COMPARE1);
+        nrf_timer_cc_set(NRF_TIMER0, NRF_TIMER_CC_CHANNEL1, hop_deadline);
+        nrfx_ppi_channel_enable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1]
+        nrfx_ppi_channel_enable(NRF_PPI_CHANNEL22);  // T0[1] -> RADIO_DISABLE
+    }
+}
+
+// Start hopping from the first channel of the hop table, if any. Called with the radio disabled.
+static void hop_start(void)
+{
+    hop_active = hop_table.count > 0;
+    if (hop_active) {
+        hop_index = 0;
+        nrf_radio_frequency_set(NRF_RADIO, 2400 + hop_table.channels[0]);
+        hop_timer_start();
+    }
+}
 
-            memcpy(pkt.data, sniffer_rx_buffer.data, pkt.length);
+// Keep the dwell timer and the ISR from restarting RX, before disabling the radio from thread context
+static void sniffer_pause(void)
+{
+    unsigned int key = irq_lock();
+    sniffer_paused = true;
+    nrfx_ppi_channel_disable(NRF_PPI_CHANNEL26);
+    nrfx_ppi_channel_disable(NRF_PPI_CHANNEL22);
+    nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
+    irq_unlock(key);
+}
+
+// Store the packet received, if any, and restart RX in the next slot. When hopping, RX is also
+// stopped without any packet received at the end of the dwell time.
+static void sniffer_isr(bool received)
+{
+    bool valid = false;
+
+    if (received) {
+        uint8_t pipe = nrf_radio_rxmatch_get(NRF_RADIO);
+        bool stored;
+
+        if (discovery_active) {
+            // Raw frame received after the packet length field, which is free to be set here
+            rx_ring_slot()->length = ESB_DISCOVERY_FRAME_LENGTH;
+            valid = true;
+            stored = rx_ring_commit(pipe, 0);
+        } else {
+            valid = nrf_radio_crc_status_check(NRF_RADIO);
+            // Packets with a CRC error are only kept in extended records, that flag them
+            bool keep = valid || (sniffer_keep_crc_errors && rx_extended_records);
+            // Read before the record header is written over the S1 field
+            uint8_t packet_pid = (rx_ring_slot()->s1 >> 1) & 0x03;
+            stored = keep && sniffer_filter_accept(pipe, valid) &&
+                     rx_ring_commit(pipe, valid ? 0 : ESB_SNIFFER_RECORD_CRC_ERROR);
+            // The CRC of a corrupted packet does not identify it
+            if (stored && valid) {
+                sniffer_filter_stored(pipe, packet_pid);
+            }
+        }
 
-            sniffer_callback(&pkt);
+        if (stored && sniffer_callback) {
+            sniffer_callback();
         }
+    }
+
+    // Receive the next packet in the next free slot, or in the same one if it was dropped
+    if (discovery_active) {
+        nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot()->data);
+    } else {
+        nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+    }
 
-        // Reset packet pointer for next reception
-        nrf_radio_packetptr_set(NRF_RADIO, &sniffer_rx_buffer);
+    if (!hop_active) {
         // Radio auto-restarts via DISABLED->RXEN short
         return;
     }
 
+    uint32_t now = timer0_now();
+    bool hop = valid && (hop_table.flags & ESB_HOP_ON_PACKET);
+
+    // The deadline may have passed while a packet was being received
+    if (hop_table.dwell_us > 0 && (int32_t)(hop_deadline - now) < HOP_MIN_TIME_LEFT_US) {
+        hop = true;
+    }
+
+    if (hop) {
+        hop_index = (hop_index + 1) % hop_table.count;
+        nrf_radio_frequency_set(NRF_RADIO, 2400 + hop_table.channels[hop_index]);
+        hop_deadline = now + hop_table.dwell_us;
+    }
+
+    if (hop_table.dwell_us > 0) {
+        // CC1 has been overwritten if an address has been received
+        nrf_timer_event_clear(NRF_TIMER0, NRF_TIMER_EVENT_COMPARE1);
+        nrf_timer_cc_set(NRF_TIMER0, NRF_TIMER_CC_CHANNEL1, hop_deadline);
+    }
+
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+#define PRX_SHORTS (RADIO_SHORTS_READY_START_Msk | RADIO_SHORTS_END_DISABLE_Msk | \
+                    NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK | NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK)
+
+// Receive the next packet in the next free slot, or in the same one if it was dropped
+static void prx_start_rx(void)
+{
+    nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+}
+
+static void prx_isr(void)
+{
+    if (prx_state == prx_state_tx_ack) {
+        // Ack sent, the radio is ramping up to RX via the DISABLED->RXEN short
+        nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+        nrf_radio_shorts_set(NRF_RADIO, PRX_SHORTS);
+        fem_txen_set(false);
+        fem_rxen_set(true);
+        prx_state = prx_state_rx;
+        return;
+    }
+
+    // Packet received, the radio is disabled until it is started here in TX for the ack or
+    // back in RX. Nothing is started before the packet has been checked, so there is never a
+    // transfer to abort.
+    bool crc_ok = nrf_radio_crc_status_check(NRF_RADIO);
+    uint8_t pipe = nrf_radio_rxmatch_get(NRF_RADIO);
+    struct esbPacket_s *rx_packet = rx_ring_slot();
+    uint8_t rx_pid = (rx_packet->s1 >> 1) & 0x03;
+    bool ack_requested = rx_packet->s1 & 0x01;
+
+    if (!crc_ok) {
+        prx_start_rx();
+        return;
+    }
+
+    // Retransmission of the last received packet: the PTX missed our ack
+    uint32_t crc = nrf_radio_rxcrc_get(NRF_RADIO);
+    bool retransmit = ackFifo[pipe].has_last && ackFifo[pipe].last_pid == rx_pid &&
+                      ackFifo[pipe].last_crc == crc;
+
+    if (!retransmit) {
+        ackFifo[pipe].has_last = true;
+        ackFifo[pipe].last_pid = rx_pid;
+        ackFifo[pipe].last_crc = crc;
+
+        // A new packet means that the previous ack payload has been received
+        if (ackFifo[pipe].in_flight) {
+            ackFifo[pipe].tail = (ackFifo[pipe].tail + 1) % ESB_ACK_PAYLOAD_QUEUE_DEPTH;
+            ackFifo[pipe].count -= 1;
+            ackFifo[pipe].in_flight = false;
+        }
+    }
+
+    if (ack_requested) {
+        struct esbPacket_s *ack = &prx_empty_ack;
+        if (ackFifo[pipe].count > 0) {
+            ack = &ackFifo[pipe].packets[ackFifo[pipe].tail];
+            ackFifo[pipe].in_flight = true;
+        }
+        ack->s1 = rx_pid << 1;
+
+        nrf_radio_txaddress_set(NRF_RADIO, pipe);
+        nrf_radio_packetptr_set(NRF_RADIO, ack);
+        nrf_radio_shorts_set(NRF_RADIO, PRX_SHORTS | RADIO_SHORTS_DISABLED_RXEN_Msk);
+        fem_rxen_set(false);
+        fem_txen_set(true);
+        prx_state = prx_state_tx_ack;
+        nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+    }
+
+    // The next packet is received in the next slot, set when the radio goes back to RX
+    if (!retransmit && rx_ring_commit(pipe, 0) && prx_callback) {
+        prx_callback();
+    }
+
+    if (!ack_requested) {
+        prx_start_rx();
+    }
+}
+
+static void radio_isr(void *arg)
+{
+    // Not set when RX has been stopped before the end of a packet
+    bool end = nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END);
+
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+
+    if (prx_active) {
+        prx_isr();
+        return;
+    }
+
+    if (sniffer_paused) {
+        k_sem_give(&radioXferDone);
+        return;
+    }
+
+    if (sniffer_active) {
+        sniffer_isr(end);
+        return;
+    }
+
     if (sending) {
         // Packet sent!, the radio is currently switching to RX mode
         // We need to setup the timeout timer, the END time is
@@ -110,7 +802,7 @@ static void radio_isr(void *arg)
 
             // Set timeout time
             uint32_t endTime = nrf_timer_cc_get(NRF_TIMER0, NRF_TIMER_CC_CHANNEL2);
-            nrf_timer_cc_set(NRF_TIMER0, NRF_TIMER_CC_CHANNEL1, endTime + 500);
+            nrf_timer_cc_set(NRF_TIMER0, NRF_TIMER_CC_CHANNEL1, endTime + ack_timeout_us);
 
             // Configure PPI
             nrfx_ppi_channel_disable(NRF_PPI_CHANNEL27); // RADIO_END -> T0[2]
@@ -124,7 +816,9 @@ static void radio_isr(void *arg)
             sending = false;
             timeout = false;
         } else {
-            k_sem_give(&radioXferDone);
+            // No ack expected, the packet is sent once
+            arc_counter += 1;
+            tx_complete();
         }
     } else {
         // Packet received or timeout
@@ -137,8 +831,16 @@ static void radio_isr(void *arg)
         nrfx_ppi_channel_disable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1] (Disables timeout!)
         nrfx_ppi_channel_disable(NRF_PPI_CHANNEL22);  // T0[1] -> RADIO_DISABLE (Timeout!)
 
+        ack_received = (!timeout) && nrf_radio_crc_status_check(NRF_RADIO);
+        arc_counter += 1;
 
-        k_sem_give(&radioXferDone);
+        // Retry right away from the ISR, the thread is only woken up with the final result
+        if (!ack_received && arc_counter <= arc) {
+            ptx_start_attempt();
+            return;
+        }
+
+        tx_complete();
     }
 }
 
@@ -165,6 +867,9 @@ void esb_init()
     nrf_timer_prescaler_set(NRF_TIMER0, NRF_TIMER_FREQ_1MHz);
     nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_CLEAR);
     nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_START);
+    time_wraps = 0;
+    time_last = 0;
+    k_timer_start(&timeWrapTimer, TIME_WRAP_CHECK_PERIOD, TIME_WRAP_CHECK_PERIOD);
 
     nrf_radio_power_set(NRF_RADIO, true);
 
@@ -189,6 +894,7 @@ void esb_init()
     // Configure Addresses
     nrf_radio_base0_set(NRF_RADIO, 0xe7e7e7e7);
     nrf_radio_prefix0_set(NRF_RADIO, 0x000000e7);
+    tx_pipe = 0;
     nrf_radio_txaddress_set(NRF_RADIO, 0);
     nrf_radio_rxaddresses_set(NRF_RADIO, 0x01u);
 
@@ -196,6 +902,21 @@ void esb_init()
     nrf_radio_crc_configure(NRF_RADIO, 2, NRF_RADIO_CRC_ADDR_INCLUDE, 0x11021UL);
     nrf_radio_crcinit_set(NRF_RADIO, 0xfffful);
 
+    // Channels left by a previous esb_init() without esb_deinit() are reused
+    ppi_release_all();
+
+    // Timestamp received packets at the radio address event, without ISR latency
+    if (!ppi_connect(nrf_radio_event_address_get(NRF_RADIO, NRF_RADIO_EVENT_ADDRESS),
+                     nrf_timer_task_address_get(NRF_TIMER0, NRF_TIMER_TASK_CAPTURE3))) {
+        LOG_ERR("Cannot allocate the timestamp PPI channel");
+    }
+
+    // Radio event counters
+    radio_counter_init(NRF_TIMER1, NRF_RADIO_EVENT_ADDRESS);
+    radio_counter_init(NRF_TIMER2, NRF_RADIO_EVENT_CRCOK);
+    radio_counter_init(NRF_TIMER3, NRF_RADIO_EVENT_CRCERROR);
+    radio_counter_init(NRF_TIMER4, NRF_RADIO_EVENT_RXREADY);
+
     // Acquire RSSI at radio address
     nrf_radio_shorts_enable(NRF_RADIO, NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK | NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
 
@@ -207,6 +928,9 @@ void esb_init()
 
     ack_enabled = true;
     arc = 3;
+    ard = ESB_ARD_DEFAULT;
+    bitrate = radioBitrate2M;
+    update_ack_timeout();
 
     isInit = true;
 }
@@ -214,6 +938,7 @@ void esb_init()
 void esb_deinit()
 {
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
 
     isInit = false;
 
@@ -222,6 +947,8 @@ void esb_deinit()
     k_sleep(K_USEC(200));
     nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
     nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_STOP);
+    k_timer_stop(&timeWrapTimer);
+    ppi_release_all();
     nrf_radio_power_set(NRF_RADIO, false);
     irq_disable(RADIO_IRQn);
 
@@ -232,201 +959,299 @@ void esb_deinit()
 
 void esb_set_arc(int value) {
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
     arc = value & 0x0f;
     k_mutex_unlock(&radio_busy);
 }
 
+void esb_set_ard(uint8_t value) {
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+    ard = value;
+    update_ack_timeout();
+    k_mutex_unlock(&radio_busy);
+}
+
 void esb_set_ack_enabled(bool enabled) {
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
     ack_enabled = enabled;
     k_mutex_unlock(&radio_busy);
 }
 
-void esb_set_channel(uint8_t channel)
+void esb_set_channel(uint8_t new_channel)
 {
     k_mutex_lock(&radio_busy, K_FOREVER);
-    if (channel <= 100) {
-        nrf_radio_frequency_set(NRF_RADIO, 2400+channel);
+    wait_tx_idle();
+    if (new_channel <= 100) {
+        // When hopping, the frequency is set from the hop table
+        if (!hop_active) {
+            nrf_radio_frequency_set(NRF_RADIO, 2400+new_channel);
+        }
+        channel = new_channel;
     }
     k_mutex_unlock(&radio_busy);
 }
 
-void esb_set_bitrate(esbBitrate_t bitrate)
+void esb_set_bitrate(esbBitrate_t new_bitrate)
 {
     k_mutex_lock(&radio_busy, K_FOREVER);
-    switch(bitrate) {
+    wait_tx_idle();
+    switch(new_bitrate) {
         case radioBitrate1M:
             nrf_radio_mode_set(NRF_RADIO, RADIO_MODE_MODE_Nrf_1Mbit);
+            bitrate = new_bitrate;
             break;
         case radioBitrate2M:
             nrf_radio_mode_set(NRF_RADIO, RADIO_MODE_MODE_Nrf_2Mbit);
+            bitrate = new_bitrate;
             break;
     }
+    // The ack airtime depends on the bitrate
+    update_ack_timeout();
     k_mutex_unlock(&radio_busy);
 }
 
-static uint32_t swap_bits(uint32_t inp)
+// The radio sends the address bytes LSB first while ESB sends them MSB first,
+// the bits of each byte are reversed with RBIT (the whole word) and REV (back to the byte order)
+static inline uint32_t swap_bits(uint32_t inp)
 {
-  uint32_t i;
-  uint32_t retval = 0;
-
-  inp = (inp & 0x000000FFUL);
-
-  for(i = 0; i < 8; i++)
-  {
-    retval |= ((inp >> i) & 0x01) << (7 - i);
-  }
-
-  return retval;
+  return __RBIT(inp) >> 24;
 }
 
-static uint32_t bytewise_bitswap(uint32_t inp)
+static inline uint32_t bytewise_bitswap(uint32_t inp)
 {
-  return (swap_bits(inp >> 24) << 24)
-       | (swap_bits(inp >> 16) << 16)
-       | (swap_bits(inp >> 8) << 8)
-       | (swap_bits(inp));
+  return __REV(__RBIT(inp));
 }
 
-void esb_set_address(uint8_t address[5])
+// Write the address of a logical address (pipe). Pipe 0 uses BASE0, pipes 1 to 7 share BASE1.
+static void set_pipe_address_nolock(uint8_t pipe, const uint8_t address[5])
 {
-    k_mutex_lock(&radio_busy, K_FOREVER);
-    memcpy(current_pipe0_address, address, 5);
-    uint32_t base0 = address[1]<<24 | address[2]<<16 | address[3]<<8 | address[4];
-    nrf_radio_base0_set(NRF_RADIO, bytewise_bitswap(base0));
-    uint32_t prefix0 = nrf_radio_prefix0_get(NRF_RADIO);
-    prefix0 = (prefix0 & 0xffffff00) | (swap_bits(address[0]) & 0x0ff);
-    nrf_radio_prefix0_set(NRF_RADIO, prefix0);
-    k_mutex_unlock(&radio_busy);
+    uint32_t base = bytewise_bitswap(address[1]<<24 | address[2]<<16 | address[3]<<8 | address[4]);
+    uint32_t prefix = swap_bits(address[0]);
+    int shift = (pipe % 4) * 8;
+
+    if (pipe == 0) {
+        nrf_radio_base0_set(NRF_RADIO, base);
+        memcpy(current_pipe0_address, address, 5);
+    } else {
+        nrf_radio_base1_set(NRF_RADIO, base);
+        // The base is shared by pipes 1 to 7
+        for (int i = 1; i < ESB_NUM_PIPES; i++) {
+            memcpy(&pipe_addresses[i][1], &address[1], 4);
+        }
+        pipe_addresses[pipe][0] = address[0];
+    }
+
+    if (pipe < 4) {
+        nrf_radio_prefix0_set(NRF_RADIO, (nrf_radio_prefix0_get(NRF_RADIO) & ~(0xffu << shift)) | (prefix << shift));
+    } else {
+        nrf_radio_prefix1_set(NRF_RADIO, (nrf_radio_prefix1_get(NRF_RADIO) & ~(0xffu << shift)) | (prefix << shift));
+    }
 }
 
-void esb_set_packet_loss_simulation(uint8_t packet_loss, uint8_t ack_loss)
+// Select the logical address used to send, and to receive the acks, in PTX mode
+static void set_tx_pipe_nolock(uint8_t pipe)
+{
+    tx_pipe = pipe;
+    nrf_radio_txaddress_set(NRF_RADIO, tx_pipe);
+    nrf_radio_rxaddresses_set(NRF_RADIO, 1u << tx_pipe);
+}
+
+void esb_set_address(uint8_t address[5])
 {
     k_mutex_lock(&radio_busy, K_FOREVER);
-    packet_loss_percent = packet_loss;
-    ack_loss_percent = ack_loss;
+    wait_tx_idle();
+    set_pipe_address_nolock(0, address);
+    if (tx_pipe != 0 && !sniffer_active && !prx_active) {
+        set_tx_pipe_nolock(0);
+    }
     k_mutex_unlock(&radio_busy);
 }
 
-bool esb_send_packet(struct esbPacket_s *packet, struct esbPacket_s * ack, uint8_t *rssi, uint8_t* retry)
+void esb_set_radio_config(const struct esbRadioConfig_s *config)
 {
-    if (!isInit) {
-        return false;
+    k_mutex_lock(&radio_busy, K_FOREVER);
+
+    bool address_changed = memcmp(config->address, current_pipe0_address, 5) != 0;
+    bool channel_changed = config->channel <= 100 && config->channel != channel;
+    bool bitrate_changed = config->bitrate != bitrate;
+    bool ack_changed = config->ack_enabled != ack_enabled;
+    bool pipe_changed = tx_pipe != 0;
+
+    // Fast path when streaming to the same target: queued packets keep flowing
+    if (!address_changed && !channel_changed && !bitrate_changed && !ack_changed && !pipe_changed) {
+        k_mutex_unlock(&radio_busy);
+        return;
     }
 
-    if (continuous_carrier_enabled || sniffer_active) {
-        return false;
+    // Computed before waiting so that the radio is idle for as short as possible
+    uint32_t base0 = 0;
+    uint32_t prefix0 = 0;
+    if (address_changed) {
+        base0 = bytewise_bitswap(config->address[1]<<24 | config->address[2]<<16 | config->address[3]<<8 | config->address[4]);
+        prefix0 = (nrf_radio_prefix0_get(NRF_RADIO) & 0xffffff00) | swap_bits(config->address[0]);
+    }
+
+    wait_tx_idle();
+
+    unsigned int key = irq_lock();
+    if (address_changed) {
+        nrf_radio_base0_set(NRF_RADIO, base0);
+        nrf_radio_prefix0_set(NRF_RADIO, prefix0);
+        memcpy(current_pipe0_address, config->address, 5);
     }
+    if (pipe_changed) {
+        set_tx_pipe_nolock(0);
+    }
+    if (channel_changed) {
+        nrf_radio_frequency_set(NRF_RADIO, 2400+config->channel);
+        channel = config->channel;
+    }
+    if (bitrate_changed) {
+        nrf_radio_mode_set(NRF_RADIO, (config->bitrate == radioBitrate1M) ? RADIO_MODE_MODE_Nrf_1Mbit : RADIO_MODE_MODE_Nrf_2Mbit);
+        bitrate = config->bitrate;
+        update_ack_timeout();
+    }
+    ack_enabled = config->ack_enabled;
+    irq_unlock(key);
+
+    k_mutex_unlock(&radio_busy);
+}
 
+void esb_set_packet_loss_simulation(uint8_t packet_loss, uint8_t ack_loss)
+{
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+    packet_loss_percent = packet_loss;
+    ack_loss_percent = ack_loss;
+    k_mutex_unlock(&radio_busy);
+}
 
-    static int lossCounter = 0;
-    static int ackLossCounter = 0;
+static void tx_watchdog_expired(struct k_timer *timer)
+{
+    unsigned int key = irq_lock();
 
-    // Drop packet occasionally
-    if (packet_loss_percent != 0 && (sys_rand32_get() % 100) < packet_loss_percent) {
-        lossCounter = 0;
+    if (txQueueCount > 0) {
+        // The radio state machine is stuck! Reset the radio and report the packet as lost
+        LOG_WRN("Radio state machine stuck, resetting radio");
 
-        k_mutex_unlock(&radio_busy);
+        LOG_DBG("Interrupt state: sending: %d, attempts: %d", sending, arc_counter);
 
-        return false;
-    } else {
-        // Handling packet PID. S1 format is | PID(2) | ACK flag |
-        packet->s1 = ((pid & 0x03)<<1) | 1;
-        pid++;
+        unsigned int radio_state = nrf_radio_state_get(NRF_RADIO);
+        if (radio_state <= 12) {
+            LOG_DBG("Radio state: %s", radio_states[radio_state]);
+        } else {
+            LOG_DBG("Radio state: Invalid (%d)", radio_state);
+        }
 
-        bool ack_received = false;
+        // Print all information about the radio packet
+        LOG_DBG("Packet length: %d", txPacket->length);
+        LOG_DBG("Packet PID: %d", txPacket->s1);
+        LOG_HEXDUMP_DBG(txPacket, txPacket->length + 2, "Packet data:");
 
-        int arc_counter = 0;
+        nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+        nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
+        nrfx_ppi_channel_disable(NRF_PPI_CHANNEL22);
+        fem_txen_set(false);
+        fem_rxen_set(false);
+        nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
 
-        do {
-            // Enable disabled interrupt only, the rest is handled by shorts
-            nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
-            nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+        ack_received = false;
+        tx_complete();
+    }
 
-            nrf_radio_shorts_enable(NRF_RADIO, RADIO_SHORTS_READY_START_Msk |
-                                        RADIO_SHORTS_END_DISABLE_Msk);
-            if (ack_enabled) {
-                nrf_radio_shorts_enable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
-            }
-            nrf_ppi_channel_enable(NRF_PPI, NRF_PPI_CHANNEL27); // END -> Timer0 Capture[2]
-            nrfx_ppi_channel_enable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1]  (debug)
+    irq_unlock(key);
+}
 
-            nrf_radio_packetptr_set(NRF_RADIO, packet);
-            ack->length = 0;
-            ackBuffer = ack;
+static bool submit(struct esbTxDesc_s *desc, esb_tx_cb_t cb, bool wait)
+{
+    if (!isInit) {
+        return false;
+    }
 
-            // Enable FEM PA
-            fem_txen_set(true);
+    if (continuous_carrier_enabled || sniffer_active || prx_active) {
+        return false;
+    }
 
-            sending = true;
-            nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_TXEN);
+    k_mutex_lock(&radio_busy, K_FOREVER);
 
-            if (k_sem_take(&radioXferDone, K_MSEC(200)) != 0) {
-                // The radio state machine is stuck! Reset the radio and returns that the packet is lost
-                LOG_WRN("Radio state machine stuck, resetting radio");
+    if (txQueueCount >= ESB_TX_QUEUE_DEPTH) {
+        if (!wait) {
+            k_mutex_unlock(&radio_busy);
+            return false;
+        }
+        wait_tx_idle();
+    }
 
-                LOG_DBG("Interrupt state: sending: %d", sending);
+    // Packet and ack loss simulation are decided here since random numbers
+    // cannot be generated from the radio ISR
+    desc->drop_packet = packet_loss_percent != 0 && (sys_rand32_get() % 100) < packet_loss_percent;
+    desc->drop_ack = ack_loss_percent != 0 && (sys_rand32_get() % 100) < ack_loss_percent;
 
-                unsigned int radio_state = nrf_radio_state_get(NRF_RADIO);
-                if (radio_state <= 12) {
-                    LOG_DBG("Radio state: %s", radio_states[radio_state]);
-                } else {
-                    LOG_DBG("Radio state: Invalid (%d)", radio_state);
-                }
+    unsigned int key = irq_lock();
 
-                // Print all information about the radio packet
-                LOG_DBG("Packet length: %d", packet->length);
-                LOG_DBG("Packet PID: %d", packet->s1);
-                LOG_HEXDUMP_DBG(packet, packet->length + 2, "Packet data:");
+    txQueue[txQueueHead].desc = desc;
+    txQueue[txQueueHead].cb = cb;
+    txQueueHead = (txQueueHead + 1) % ESB_TX_QUEUE_DEPTH;
+    txQueueCount += 1;
 
-                irq_disable(RADIO_IRQn);
-                nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
-                k_sem_reset(&radioXferDone);
-                k_mutex_unlock(&radio_busy);
-                irq_enable(RADIO_IRQn);
+    // Start the radio if it is idle, otherwise the ISR will pick up the packet
+    if (k_sem_take(&txIdle, K_NO_WAIT) == 0) {
+        tx_start_next();
+    }
 
-                return false;
-            }
+    irq_unlock(key);
 
-            // We do not need the interrupt anymore
-            nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+    k_mutex_unlock(&radio_busy);
 
-            // Clean up after ourselves
-            nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_READY_START_Msk |
-                                        RADIO_SHORTS_END_DISABLE_Msk);
-            if (ack_enabled) {
-                nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
-            }
-            nrf_ppi_channel_disable(NRF_PPI, NRF_PPI_CHANNEL27); // END -> Timer0 Capture[2]
-            nrfx_ppi_channel_disable(NRF_PPI_CHANNEL26);  // RADIO_ADDR -> T0[1]  (debug)
+    return true;
+}
 
-            // Check if ack received
-            ack_received = (!timeout) && nrf_radio_crc_status_check(NRF_RADIO) && ack_enabled;
+bool esb_submit(struct esbTxDesc_s *desc, esb_tx_cb_t cb)
+{
+    return submit(desc, cb, false);
+}
 
-            arc_counter += 1;
+void esb_flush(void)
+{
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+    k_mutex_unlock(&radio_busy);
+}
 
-            // If ack is not enabled, it is normal to not receive an ack
-            if (ack_received || !ack_enabled) {
-                break;
-            }
+static void send_packet_done(struct esbTxDesc_s *desc)
+{
+    k_sem_give(&radioXferDone);
+}
 
-        } while (arc_counter <= arc);
-        
-        *rssi = nrf_radio_rssi_sample_get(NRF_RADIO);
-        *retry = arc_counter - 1;
+bool esb_send_packet(struct esbPacket_s *packet, struct esbPacket_s * ack, uint8_t *rssi, uint8_t* retry)
+{
+    static struct esbTxDesc_s desc;
 
-        // Drop ack packet occasionally
-        if (ack_loss_percent != 0 && (sys_rand32_get() % 100) < ack_loss_percent) {
-            ackLossCounter = 0;
-            k_mutex_unlock(&radio_busy);
-            return false;
-        }
+    // radioXferDone is shared by all synchronous callers
+    static K_MUTEX_DEFINE(send_packet_lock);
+    k_mutex_lock(&send_packet_lock, K_FOREVER);
 
-        k_mutex_unlock(&radio_busy);
+    desc.packet = packet;
+    desc.ack = ack;
+    ack->length = 0;
 
-        return ack_received;
+    if (!submit(&desc, send_packet_done, true)) {
+        k_mutex_unlock(&send_packet_lock);
+        return false;
     }
+
+    // The TX watchdog guarantees that the packet is completed
+    k_sem_take(&radioXferDone, K_FOREVER);
+
+    *rssi = desc.rssi;
+    *retry = desc.retry;
+    bool acked = desc.acked;
+
+    k_mutex_unlock(&send_packet_lock);
+
+    return acked;
 }
 
 bool esb_set_continuous_carrier(bool enable) {
@@ -434,7 +1259,7 @@ bool esb_set_continuous_carrier(bool enable) {
         return false;
     }
 
-    if (sniffer_active) {
+    if (sniffer_active || prx_active) {
         return false;
     }
 
@@ -443,6 +1268,7 @@ bool esb_set_continuous_carrier(bool enable) {
     }
 
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
     if (enable) {
         fem_txen_set(true);
 
@@ -462,27 +1288,163 @@ bool esb_set_continuous_carrier(bool enable) {
     return true;
 }
 
-void esb_set_address_pipe1(uint8_t address[5])
+// Poll a radio event, for the functions that drive the radio without its interrupt
+static bool wait_radio_event(nrf_radio_event_t event, uint32_t timeout_us)
+{
+    for (uint32_t waited_us = 0; !nrf_radio_event_check(NRF_RADIO, event); waited_us++) {
+        if (waited_us >= timeout_us) {
+            return false;
+        }
+        k_busy_wait(1);
+    }
+
+    return true;
+}
+
+// Longer intervals between RSSI samples are slept instead of spun
+#define RSSI_BUSY_WAIT_MAX_US 50
+// The RX ramp-up takes up to 140us, an RSSI sample 0.25us and disabling RX a few us
+#define RSSI_READY_TIMEOUT_US 500
+#define RSSI_SAMPLE_TIMEOUT_US 20
+#define RSSI_DISABLE_TIMEOUT_US 50
+
+bool esb_measure_rssi(uint8_t measured_channel, int samples, uint32_t interval_us, struct esbRssiStats_s *stats)
 {
+    // Receive buffer, the packets received during the measurement are not used
+    static struct esbPacket_s scratch;
+    uint32_t sum = 0;
+
+    stats->min = ESB_RSSI_INVALID;
+    stats->mean = ESB_RSSI_INVALID;
+    stats->max = ESB_RSSI_INVALID;
+
+    if (!isInit || measured_channel > 100 || samples < 1) {
+        return false;
+    }
+
     k_mutex_lock(&radio_busy, K_FOREVER);
-    uint32_t base1 = address[1]<<24 | address[2]<<16 | address[3]<<8 | address[4];
-    nrf_radio_base1_set(NRF_RADIO, bytewise_bitswap(base1));
-    uint32_t prefix0 = nrf_radio_prefix0_get(NRF_RADIO);
-    prefix0 = (prefix0 & 0xffff00ff) | ((swap_bits(address[0]) & 0xff) << 8);
-    nrf_radio_prefix0_set(NRF_RADIO, prefix0);
+    wait_tx_idle();
+
+    if (continuous_carrier_enabled || sniffer_active || prx_active) {
+        k_mutex_unlock(&radio_busy);
+        return false;
+    }
+
+    // Without the radio interrupt, nothing but this function drives the radio
+    nrf_radio_packetptr_set(NRF_RADIO, &scratch);
+    nrf_radio_frequency_set(NRF_RADIO, 2400 + measured_channel);
+    fem_rxen_set(true);
+
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_READY);
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+    bool ok = wait_radio_event(NRF_RADIO_EVENT_READY, RSSI_READY_TIMEOUT_US);
+
+    uint8_t min = 0xff;
+    uint8_t max = 0;
+    for (int i = 0; ok && i < samples; i++) {
+        if (i > 0 && interval_us > RSSI_BUSY_WAIT_MAX_US) {
+            k_usleep(interval_us);
+        } else if (i > 0) {
+            k_busy_wait(interval_us);
+        }
+
+        // The radio stops receiving at the end of a packet, it is restarted
+        if (i == 0 || nrf_radio_event_check(NRF_RADIO, NRF_RADIO_EVENT_END)) {
+            nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+            nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_START);
+        }
+
+        nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_RSSIEND);
+        nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RSSISTART);
+        ok = wait_radio_event(NRF_RADIO_EVENT_RSSIEND, RSSI_SAMPLE_TIMEOUT_US);
+
+        uint8_t sample = nrf_radio_rssi_sample_get(NRF_RADIO);
+        min = MIN(min, sample);
+        max = MAX(max, sample);
+        sum += sample;
+    }
+
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
+    if (!wait_radio_event(NRF_RADIO_EVENT_DISABLED, RSSI_DISABLE_TIMEOUT_US)) {
+        LOG_ERR("Radio not disabled after RSSI measurement");
+    }
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_END);
+
+    fem_rxen_set(false);
+    nrf_radio_frequency_set(NRF_RADIO, 2400 + channel);
+
+    k_mutex_unlock(&radio_busy);
+
+    if (!ok) {
+        LOG_WRN("RSSI measurement on channel %d timed out", measured_channel);
+        return false;
+    }
+
+    stats->min = min;
+    stats->mean = sum / samples;
+    stats->max = max;
+    return true;
+}
+
+void esb_set_address_pipe(uint8_t pipe, uint8_t address[5])
+{
+    if (pipe >= ESB_NUM_PIPES) {
+        return;
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+    set_pipe_address_nolock(pipe, address);
+    k_mutex_unlock(&radio_busy);
+}
+
+void esb_set_tx_pipe(uint8_t pipe)
+{
+    if (pipe >= ESB_NUM_PIPES) {
+        return;
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    if (pipe != tx_pipe) {
+        wait_tx_idle();
+        if (sniffer_active || prx_active) {
+            // Applied when going back to PTX mode
+            tx_pipe = pipe;
+        } else {
+            set_tx_pipe_nolock(pipe);
+        }
+    }
+    k_mutex_unlock(&radio_busy);
+}
+
+void esb_set_rx_pipes(uint8_t pipes)
+{
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    rx_pipes = pipes;
+    if (prx_active) {
+        nrf_radio_rxaddresses_set(NRF_RADIO, rx_pipes);
+    }
     k_mutex_unlock(&radio_busy);
 }
 
 void esb_sniffer_start(esb_sniffer_rx_cb_t cb)
 {
-    if (!isInit || sniffer_active) {
+    if (!isInit || sniffer_active || prx_active) {
         return;
     }
 
     k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
 
     sniffer_active = true;
     sniffer_callback = cb;
+    rx_ring_reset();
+    radio_counters_reset();
+    for (int pipe = 0; pipe < ESB_NUM_PIPES; pipe++) {
+        sniffer_last[pipe].valid = false;
+    }
 
     // Reconfigure radio for max packet length
     nrf_radio_packet_conf_t radioConfig = {0,};
@@ -496,20 +1458,16 @@ void esb_sniffer_start(esb_sniffer_rx_cb_t cb)
     radioConfig.whiteen = false;
     nrf_radio_packet_configure(NRF_RADIO, &radioConfig);
 
-    // Enable RX on pipes 0 and 1
-    nrf_radio_rxaddresses_set(NRF_RADIO, 0x03u);
+    nrf_radio_rxaddresses_set(NRF_RADIO, sniffer_pipes);
 
     // Set packet pointer
-    nrf_radio_packetptr_set(NRF_RADIO, &sniffer_rx_buffer);
+    nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+
+    hop_start();
 
     // Configure continuous RX shorts:
-    // READY->START, END->DISABLE, DISABLED->RXEN, ADDRESS->RSSISTART, DISABLED->RSSISTOP
-    nrf_radio_shorts_set(NRF_RADIO,
-        RADIO_SHORTS_READY_START_Msk |
-        RADIO_SHORTS_END_DISABLE_Msk |
-        RADIO_SHORTS_DISABLED_RXEN_Msk |
-        NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK |
-        NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
+    // READY->START, END->DISABLE, DISABLED->RXEN (unless hopping), ADDRESS->RSSISTART, DISABLED->RSSISTOP
+    nrf_radio_shorts_set(NRF_RADIO, sniffer_shorts());
 
     // Enable DISABLED interrupt
     nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
@@ -518,27 +1476,89 @@ void esb_sniffer_start(esb_sniffer_rx_cb_t cb)
     // Enable FEM for RX
     fem_rxen_set(true);
 
-    // Clear TIMER0 for clean relative timestamps
-    nrf_timer_task_trigger(NRF_TIMER0, NRF_TIMER_TASK_CLEAR);
-
     // Start RX
     nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
 
     k_mutex_unlock(&radio_busy);
 }
 
-static void set_pipe0_address_nolock(uint8_t address[5])
+void esb_set_sniffer_pipes(uint8_t pipes)
+{
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    sniffer_pipes = pipes;
+    if (sniffer_active && !discovery_active) {
+        nrf_radio_rxaddresses_set(NRF_RADIO, sniffer_pipes);
+    }
+    k_mutex_unlock(&radio_busy);
+}
+
+void esb_discovery_start(esb_sniffer_rx_cb_t cb)
+{
+    if (!isInit || sniffer_active || prx_active || continuous_carrier_enabled) {
+        return;
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+
+    discovery_saved_addresses.base0 = nrf_radio_base0_get(NRF_RADIO);
+    discovery_saved_addresses.base1 = nrf_radio_base1_get(NRF_RADIO);
+    discovery_saved_addresses.prefix0 = nrf_radio_prefix0_get(NRF_RADIO);
+    discovery_saved_addresses.prefix1 = nrf_radio_prefix1_get(NRF_RADIO);
+    memcpy(discovery_saved_addresses.pipe0_address, current_pipe0_address, 5);
+
+    sniffer_active = true;
+    discovery_active = true;
+    sniffer_callback = cb;
+    rx_ring_reset();
+    radio_counters_reset();
+    rx_extended_records = false;
+
+    // Raw frames: 2 bytes address, no length field and no CRC. The frame holds the
+    // address, PCF, payload and CRC of the packet, that are validated in thread context.
+    nrf_radio_packet_conf_t radioConfig = {0,};
+    radioConfig.lflen = 0;
+    radioConfig.s0len = 0;
+    radioConfig.s1len = 0;
+    radioConfig.maxlen = ESB_DISCOVERY_FRAME_LENGTH;
+    radioConfig.statlen = ESB_DISCOVERY_FRAME_LENGTH;
+    radioConfig.balen = 1;
+    radioConfig.big_endian = true;
+    radioConfig.whiteen = false;
+    nrf_radio_packet_configure(NRF_RADIO, &radioConfig);
+    nrf_radio_crc_configure(NRF_RADIO, 0, NRF_RADIO_CRC_ADDR_INCLUDE, 0);
+
+    // The carrier sent before a packet demodulates as a run of 0s or 1s: an address made of
+    // such a byte followed by a preamble byte matches the start of any packet. The base is
+    // repeated so that the byte used with a 1 byte base does not matter.
+    set_pipe_address_nolock(0, (uint8_t[]){0x00, 0xaa, 0xaa, 0xaa, 0xaa});
+    set_pipe_address_nolock(1, (uint8_t[]){0x00, 0x55, 0x55, 0x55, 0x55});
+    set_pipe_address_nolock(2, (uint8_t[]){0xff, 0x55, 0x55, 0x55, 0x55});
+    nrf_radio_rxaddresses_set(NRF_RADIO, 0x07u);
+
+    nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot()->data);
+
+    hop_start();
+    nrf_radio_shorts_set(NRF_RADIO, sniffer_shorts());
+
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+    nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+    fem_rxen_set(true);
+
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+
+    k_mutex_unlock(&radio_busy);
+}
+
+bool esb_discovery_is_active(void)
 {
-    uint32_t base0 = address[1]<<24 | address[2]<<16 | address[3]<<8 | address[4];
-    nrf_radio_base0_set(NRF_RADIO, bytewise_bitswap(base0));
-    uint32_t prefix0 = nrf_radio_prefix0_get(NRF_RADIO);
-    prefix0 = (prefix0 & 0xffffff00) | (swap_bits(address[0]) & 0x0ff);
-    nrf_radio_prefix0_set(NRF_RADIO, prefix0);
+    return discovery_active;
 }
 
 bool esb_sniffer_send(struct esbPacket_s *packet, uint8_t address[5])
 {
-    if (!sniffer_active) {
+    if (!sniffer_active || discovery_active) {
         return false;
     }
 
@@ -548,9 +1568,8 @@ bool esb_sniffer_send(struct esbPacket_s *packet, uint8_t address[5])
     uint8_t saved_address[5];
     memcpy(saved_address, current_pipe0_address, 5);
 
-    // Stop continuous RX
-    sniffer_active = false;
-    nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
+    // Stop continuous RX, the radio interrupt then signals the end of the TX
+    sniffer_pause();
     nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
     k_sleep(K_USEC(200));
     nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
@@ -561,7 +1580,7 @@ bool esb_sniffer_send(struct esbPacket_s *packet, uint8_t address[5])
     k_sem_reset(&radioXferDone);
 
     // Set TX address to the provided address
-    set_pipe0_address_nolock(address);
+    set_pipe_address_nolock(0, address);
     nrf_radio_txaddress_set(NRF_RADIO, 0);
 
     // Transmit no-ack packet
@@ -592,19 +1611,13 @@ bool esb_sniffer_send(struct esbPacket_s *packet, uint8_t address[5])
     nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
 
     // Restore pipe 0 address for sniffer RX
-    set_pipe0_address_nolock(saved_address);
-
-    // Restart continuous RX
-    sniffer_active = true;
+    set_pipe_address_nolock(0, saved_address);
 
-    nrf_radio_packetptr_set(NRF_RADIO, &sniffer_rx_buffer);
-
-    nrf_radio_shorts_set(NRF_RADIO,
-        RADIO_SHORTS_READY_START_Msk |
-        RADIO_SHORTS_END_DISABLE_Msk |
-        RADIO_SHORTS_DISABLED_RXEN_Msk |
-        NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK |
-        NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
+    // Restart continuous RX, on the same channel when hopping
+    nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+    nrf_radio_shorts_set(NRF_RADIO, sniffer_shorts());
+    hop_timer_start();
+    sniffer_paused = false;
 
     nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
     nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
@@ -624,8 +1637,8 @@ void esb_sniffer_stop(void)
 
     k_mutex_lock(&radio_busy, K_FOREVER);
 
-    // Remove DISABLED->RXEN short to break the continuous RX loop
-    nrf_radio_shorts_disable(NRF_RADIO, RADIO_SHORTS_DISABLED_RXEN_Msk);
+    // Break the continuous RX loop
+    sniffer_pause();
 
     // Trigger DISABLE and wait for radio to stop
     nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
@@ -641,11 +1654,33 @@ void esb_sniffer_stop(void)
     // Disable FEM
     fem_rxen_set(false);
 
-    // Restore RX address to pipe 0 only
-    nrf_radio_rxaddresses_set(NRF_RADIO, 0x01u);
+    // Restore the PTX TX and RX addresses
+    set_tx_pipe_nolock(tx_pipe);
+
+    if (hop_active) {
+        // Not to be seen as an ack timeout by the next PTX transfer
+        nrf_timer_event_clear(NRF_TIMER0, NRF_TIMER_EVENT_COMPARE1);
+        nrf_radio_frequency_set(NRF_RADIO, 2400 + channel);
+        hop_active = false;
+    }
 
     sniffer_active = false;
+    sniffer_paused = false;
     sniffer_callback = NULL;
+    // Given by the radio interrupt when RX has been disabled
+    k_sem_reset(&radioXferDone);
+
+    if (discovery_active) {
+        // Restore the addresses and the CRC
+        nrf_radio_base0_set(NRF_RADIO, discovery_saved_addresses.base0);
+        nrf_radio_base1_set(NRF_RADIO, discovery_saved_addresses.base1);
+        nrf_radio_prefix0_set(NRF_RADIO, discovery_saved_addresses.prefix0);
+        nrf_radio_prefix1_set(NRF_RADIO, discovery_saved_addresses.prefix1);
+        memcpy(current_pipe0_address, discovery_saved_addresses.pipe0_address, 5);
+        nrf_radio_crc_configure(NRF_RADIO, 2, NRF_RADIO_CRC_ADDR_INCLUDE, 0x11021UL);
+        nrf_radio_crcinit_set(NRF_RADIO, 0xfffful);
+        discovery_active = false;
+    }
 
     // Restore radio to 32-byte max packet length for normal operation
     nrf_radio_packet_conf_t radioConfig = {0,};
@@ -666,3 +1701,244 @@ bool esb_sniffer_is_active(void)
 {
     return sniffer_active;
 }
+
+void esb_sniffer_set_filter(const struct esbSnifferFilter_s *filter)
+{
+    unsigned int key = irq_lock();
+    if (filter) {
+        sniffer_filter = *filter;
+        sniffer_filter_enabled = true;
+    } else {
+        sniffer_filter_enabled = false;
+    }
+    for (int pipe = 0; pipe < ESB_NUM_PIPES; pipe++) {
+        sniffer_last[pipe].valid = false;
+    }
+    irq_unlock(key);
+}
+
+void esb_sniffer_set_extended_records(bool enable)
+{
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    extended_records = enable;
+    k_mutex_unlock(&radio_busy);
+}
+
+void esb_sniffer_set_keep_crc_errors(bool enable)
+{
+    sniffer_keep_crc_errors = enable;
+}
+
+int esb_get_target_stats(struct esbTargetStats_s *stats)
+{
+    unsigned int key = irq_lock();
+    int count = target_stats_count;
+    memcpy(stats, target_stats, count * sizeof(struct esbTargetStats_s));
+    irq_unlock(key);
+
+    return count;
+}
+
+void esb_get_channel_stats(struct esbLinkStats_s *stats)
+{
+    unsigned int key = irq_lock();
+    memcpy(stats, channel_stats, sizeof(channel_stats));
+    irq_unlock(key);
+}
+
+void esb_reset_link_stats(void)
+{
+    unsigned int key = irq_lock();
+    target_stats_count = 0;
+    memset(channel_stats, 0, sizeof(channel_stats));
+    irq_unlock(key);
+}
+
+void esb_get_radio_counters(struct esbRadioCounters_s *counters)
+{
+    counters->address = radio_counter_get(NRF_TIMER1);
+    counters->crc_ok = radio_counter_get(NRF_TIMER2);
+    counters->crc_error = radio_counter_get(NRF_TIMER3);
+    counters->rx_ready = radio_counter_get(NRF_TIMER4);
+}
+
+uint64_t esb_get_time_us(void)
+{
+    unsigned int key = irq_lock();
+    uint32_t now = timer0_now();
+    if (now < time_last) {
+        time_wraps += 1;
+    }
+    time_last = now;
+    uint64_t time_us = ((uint64_t)time_wraps << 32) | now;
+    irq_unlock(key);
+
+    return time_us;
+}
+
+static void time_wrap_check(struct k_timer *timer)
+{
+    esb_get_time_us();
+}
+
+bool esb_sniffer_set_hop_table(const uint8_t *channels, int count, uint32_t dwell_us, uint8_t flags)
+{
+    if (count < 0 || count > ESB_HOP_MAX_CHANNELS) {
+        return false;
+    }
+
+    if (count > 0 && dwell_us == 0 && (flags & ESB_HOP_ON_PACKET) == 0) {
+        return false;
+    }
+
+    if (dwell_us > 0 && dwell_us < ESB_HOP_MIN_DWELL_US) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (channels[i] > 100) {
+            return false;
+        }
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    memcpy(hop_table.channels, channels, count);
+    hop_table.count = count;
+    hop_table.dwell_us = dwell_us;
+    hop_table.flags = flags;
+    k_mutex_unlock(&radio_busy);
+
+    return true;
+}
+
+const struct esbSnifferRecord_s *esb_sniffer_peek(void)
+{
+    if (rxRingTail == rxRingHead) {
+        return NULL;
+    }
+
+    return rx_ring_record(rxRingTail);
+}
+
+void esb_sniffer_release(void)
+{
+    if (rxRingTail != rxRingHead) {
+        // The record must not be used anymore when the radio gets the slot back
+        __DMB();
+        rxRingTail = (rxRingTail + 1) % ESB_SNIFFER_RING_SIZE;
+    }
+}
+
+uint32_t esb_sniffer_get_drop_count(void)
+{
+    return rx_drop_count;
+}
+
+void esb_prx_start(esb_sniffer_rx_cb_t cb)
+{
+    if (!isInit || sniffer_active || prx_active || continuous_carrier_enabled) {
+        return;
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+    wait_tx_idle();
+
+    prx_callback = cb;
+    prx_state = prx_state_rx;
+    rx_ring_reset();
+    radio_counters_reset();
+
+    for (int pipe = 0; pipe < ESB_NUM_PIPES; pipe++) {
+        ackFifo[pipe].has_last = false;
+        ackFifo[pipe].in_flight = false;
+    }
+    prx_empty_ack.length = 0;
+
+    nrf_radio_rxaddresses_set(NRF_RADIO, rx_pipes);
+    nrf_radio_packetptr_set(NRF_RADIO, rx_ring_slot());
+
+    // The ISR starts the ack TX or the next RX once a packet has been received, and the
+    // radio goes back to RX by itself after the ack
+    nrf_radio_shorts_set(NRF_RADIO, PRX_SHORTS);
+
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+    nrf_radio_int_enable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+
+    fem_rxen_set(true);
+
+    prx_active = true;
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_RXEN);
+
+    k_mutex_unlock(&radio_busy);
+}
+
+void esb_prx_stop(void)
+{
+    if (!prx_active) {
+        return;
+    }
+
+    k_mutex_lock(&radio_busy, K_FOREVER);
+
+    nrf_radio_int_disable(NRF_RADIO, NRF_RADIO_INT_DISABLED_MASK);
+    prx_active = false;
+    prx_callback = NULL;
+
+    // Break the RX/TX loop and wait for the radio to stop
+    nrf_radio_shorts_set(NRF_RADIO,
+        NRF_RADIO_SHORT_ADDRESS_RSSISTART_MASK |
+        NRF_RADIO_SHORT_DISABLED_RSSISTOP_MASK);
+    nrf_radio_task_trigger(NRF_RADIO, NRF_RADIO_TASK_DISABLE);
+    k_sleep(K_USEC(200));
+    nrf_radio_event_clear(NRF_RADIO, NRF_RADIO_EVENT_DISABLED);
+
+    fem_txen_set(false);
+    fem_rxen_set(false);
+
+    // Restore the PTX TX and RX addresses
+    set_tx_pipe_nolock(tx_pipe);
+
+    k_mutex_unlock(&radio_busy);
+}
+
+bool esb_prx_is_active(void)
+{
+    return prx_active;
+}
+
+bool esb_prx_write_ack_payload(uint8_t pipe, const uint8_t *data, uint8_t length)
+{
+    if (pipe >= ESB_NUM_PIPES || length > 32) {
+        return false;
+    }
+
+    bool queued = false;
+    unsigned int key = irq_lock();
+
+    if (ackFifo[pipe].count < ESB_ACK_PAYLOAD_QUEUE_DEPTH) {
+        struct esbPacket_s *packet = &ackFifo[pipe].packets[ackFifo[pipe].head];
+        packet->length = length;
+        memcpy(packet->data, data, length);
+        ackFifo[pipe].head = (ackFifo[pipe].head + 1) % ESB_ACK_PAYLOAD_QUEUE_DEPTH;
+        ackFifo[pipe].count += 1;
+        queued = true;
+    }
+
+    irq_unlock(key);
+
+    return queued;
+}
+
+void esb_prx_flush_ack_payloads(void)
+{
+    unsigned int key = irq_lock();
+
+    for (int pipe = 0; pipe < ESB_NUM_PIPES; pipe++) {
+        ackFifo[pipe].head = 0;
+        ackFifo[pipe].tail = 0;
+        ackFifo[pipe].count = 0;
+        ackFifo[pipe].in_flight = false;
+    }
+
+    irq_unlock(key);
+}
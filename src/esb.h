@@ -55,6 +55,29 @@ typedef enum {
  */
 void esb_set_arc(int value);
 
+/**
+ * @brief ARD bit selecting an ack payload length instead of a delay
+ */
+#define ESB_ARD_ACK_LENGTH 0x80
+
+/**
+ * @brief Default ARD: wait long enough for a 32 bytes ack payload
+ */
+#define ESB_ARD_DEFAULT (ESB_ARD_ACK_LENGTH | 32)
+
+/**
+ * @brief Set the auto retransmit delay
+ *
+ * The delay is the time waited for an ack after the end of the transmitted packet before retrying,
+ * the next attempt starts when it expires. The wait stops early when an ack is received.
+ * If bit 7 (ESB_ARD_ACK_LENGTH) is set, the lower bits are the maximum expected ack payload length
+ * and the delay is computed from the ack airtime at the current bitrate. Otherwise the delay is
+ * (\p value + 1) * 250us, with \p value from 0 to 15.
+ *
+ * @param value ARD value, same encoding as Crazyradio PA
+ */
+void esb_set_ard(uint8_t value);
+
 /**
  * @brief Set if an ack will be received or not
  * @param enabled True to receive an ack after sending a packet. False to just send.
@@ -71,10 +94,33 @@ void esb_set_bitrate(esbBitrate_t bitrate);
 
 /**
  * @brief Set the radio address
+ *
+ * The address is written to pipe 0 which is then used to send.
+ *
  * @param address Radio address
  */
 void esb_set_address(uint8_t address[5]);
 
+/**
+ * @brief Radio settings of a PTX target
+ */
+struct esbRadioConfig_s {
+    uint8_t address[5];
+    uint8_t channel;
+    esbBitrate_t bitrate;
+    bool ack_enabled;
+};
+
+/**
+ * @brief Set all the radio settings of a PTX target at once
+ *
+ * Only the settings that differ from the current ones are written to the radio. If nothing
+ * changed this returns right away, without waiting for the queued packets to be sent.
+ *
+ * @param config Radio settings, a channel above 100 is ignored
+ */
+void esb_set_radio_config(const struct esbRadioConfig_s *config);
+
 /**
  * @brief ESB radio packet
  * 
@@ -102,6 +148,55 @@ struct esbPacket_s {
 */
 bool esb_send_packet(struct esbPacket_s *packet, struct esbPacket_s * ack, uint8_t *rssi, uint8_t *retry);
 
+/**
+ * @brief Depth of the asynchronous transmit queue
+ */
+#define ESB_TX_QUEUE_DEPTH 4
+
+/**
+ * @brief Asynchronous transmit descriptor
+ *
+ * \a packet, \a ack and \a user_data are set by the caller before calling esb_submit().
+ * The result fields are filled up by the driver before the completion callback is called.
+ * The descriptor, the packet and the ack buffer must stay valid until completion.
+ */
+struct esbTxDesc_s {
+    struct esbPacket_s *packet;
+    struct esbPacket_s *ack;
+    void *user_data;
+
+    // Result
+    bool acked;
+    uint8_t rssi;
+    uint8_t retry;
+
+    // Private, used by the driver
+    bool drop_packet;
+    bool drop_ack;
+};
+
+/**
+ * @brief Transmit completion callback type (called from ISR context)
+ */
+typedef void (*esb_tx_cb_t)(struct esbTxDesc_s *desc);
+
+/**
+ * @brief Queue a packet to be sent without waiting for the ack
+ *
+ * The packet is sent with the radio settings in use when it reaches the radio. Changing a radio
+ * setting waits for all queued packets to be sent first. Packets are sent, and completed, in order.
+ *
+ * @param desc Transmit descriptor
+ * @param cb Callback called from ISR when the packet has been acked or all retries failed
+ * @return true if the packet has been queued, false if the queue is full or the radio is not in PTX mode
+ */
+bool esb_submit(struct esbTxDesc_s *desc, esb_tx_cb_t cb);
+
+/**
+ * @brief Wait for all queued packets to be sent
+ */
+void esb_flush(void);
+
 /**
  * @brief Enable or disable continuous carrier mode
  * 
@@ -114,6 +209,39 @@ bool esb_send_packet(struct esbPacket_s *packet, struct esbPacket_s * ack, uint8
  */
 bool esb_set_continuous_carrier(bool enable);
 
+/**
+ * @brief Statistics of RSSI samples, in -dBm like the other RSSI values
+ *
+ * The lowest value is the strongest level.
+ */
+struct esbRssiStats_s {
+    uint8_t min;
+    uint8_t mean;
+    uint8_t max;
+} __attribute__((packed));
+
+/**
+ * @brief Value of all the RSSI statistics of a channel that could not be measured
+ *
+ * The radio samples are 7 bits, so this can never be measured.
+ */
+#define ESB_RSSI_INVALID 0xff
+
+/**
+ * @brief Measure the energy received on a channel, without transmitting
+ *
+ * Only in PTX mode, the queued packets are sent first. The radio receives on the channel for
+ * the whole measurement and takes evenly spaced RSSI samples. The channel set with
+ * esb_set_channel() is restored afterwards.
+ *
+ * @param measured_channel Channel to measure, 0 to 100
+ * @param samples Number of RSSI samples, at least 1
+ * @param interval_us Time between two samples in microseconds, slept instead of spun above 50us
+ * @param stats Filled up with the statistics of the samples, or ESB_RSSI_INVALID on failure
+ * @return false if the radio is not in PTX mode, a parameter is invalid or the radio timed out
+ */
+bool esb_measure_rssi(uint8_t measured_channel, int samples, uint32_t interval_us, struct esbRssiStats_s *stats);
+
 /**
  * @brief Set packet loss simulation parameters
  * 
@@ -125,24 +253,203 @@ bool esb_set_continuous_carrier(bool enable);
 void esb_set_packet_loss_simulation(uint8_t packet_loss_percent, uint8_t ack_loss_percent);
 
 /**
- * @brief Sniffer received packet structure
+ * @brief Number of slots in the sniffer receive ring, one slot is always owned by the radio
  */
-struct esbSnifferPacket_s {
-    uint8_t length;
+#define ESB_SNIFFER_RING_SIZE 32
+
+/**
+ * @brief Sniffer received packet record
+ *
+ * Records are built in place in the radio receive buffers: the payload is the one received
+ * by the radio and the header is written in front of it, so a record can be sent as is.
+ */
+struct esbSnifferRecord_s {
+    uint8_t length;         // Total record length, header included
+    uint8_t rssi;
+    uint8_t pipe;
+    uint32_t timestamp_us;  // TIMER0 time of the end of the address, captured by hardware
+    uint8_t data[];
+} __attribute__((packed));
+
+/**
+ * @brief Sniffer received packet record with the channel, see esb_sniffer_set_extended_records()
+ */
+struct esbSnifferExtRecord_s {
+    uint8_t length;         // Total record length, header included
     uint8_t rssi;
     uint8_t pipe;
-    uint32_t timestamp_us;
-    uint8_t data[ESB_MAX_PAYLOAD_LENGTH];
+    uint32_t timestamp_us;  // TIMER0 time of the end of the address, captured by hardware
+    uint8_t channel;        // Channel the packet has been received on
+    uint8_t flags;          // ESB_SNIFFER_RECORD_* flags
+    uint8_t data[];
+} __attribute__((packed));
+
+/**
+ * @brief Extended record flag: the packet has been received with a CRC error
+ */
+#define ESB_SNIFFER_RECORD_CRC_ERROR 0x01
+
+/**
+ * @brief Select the record format, applied the next time sniffer or PRX mode is started
+ *
+ * When enabled, esb_sniffer_peek() returns struct esbSnifferExtRecord_s records. Their first
+ * fields are the same as struct esbSnifferRecord_s. Discovery mode always uses normal records.
+ *
+ * @param enable true for extended records, false for normal records (default)
+ */
+void esb_sniffer_set_extended_records(bool enable);
+
+/**
+ * @brief Callback type notifying that a record is available (called from ISR context)
+ */
+typedef void (*esb_sniffer_rx_cb_t)(void);
+
+/**
+ * @brief Get the oldest received record, in sniffer or PRX mode
+ *
+ * The record stays valid, and its slot is not reused by the radio, until esb_sniffer_release()
+ * is called. Only one consumer thread is supported.
+ *
+ * @return The oldest record, or NULL if there is none
+ */
+const struct esbSnifferRecord_s *esb_sniffer_peek(void);
+
+/**
+ * @brief Release the record returned by esb_sniffer_peek() and give its slot back to the radio
+ */
+void esb_sniffer_release(void);
+
+/**
+ * @brief Get the number of received packets dropped because the receive ring was full
+ */
+uint32_t esb_sniffer_get_drop_count(void);
+
+/**
+ * @brief Number of payload bytes that can be matched by the sniffer filter
+ */
+#define ESB_SNIFFER_FILTER_MATCH_LENGTH 4
+
+/**
+ * @brief Sniffer filter, evaluated in the radio ISR before a packet is stored
+ *
+ * A packet is kept if its payload length is within [min_length, max_length], it has been
+ * received on a pipe enabled in pipe_mask and (payload[i] & mask[i]) == match[i] for the
+ * first ESB_SNIFFER_FILTER_MATCH_LENGTH bytes. Bytes past the end of the payload do not match
+ * unless their mask is 0.
+ */
+struct esbSnifferFilter_s {
+    uint8_t min_length;
+    uint8_t max_length;
+    uint8_t pipe_mask;
+    // Drop the retransmissions of a packet, detected with the same PID and CRC on the same pipe
+    bool drop_duplicates;
+    uint8_t match[ESB_SNIFFER_FILTER_MATCH_LENGTH];
+    uint8_t mask[ESB_SNIFFER_FILTER_MATCH_LENGTH];
 };
 
 /**
- * @brief Callback type for sniffer received packets (called from ISR context)
+ * @brief Set the sniffer filter
+ * @param filter Filter to apply, or NULL to receive all packets
  */
-typedef void (*esb_sniffer_rx_cb_t)(const struct esbSnifferPacket_s *packet);
+void esb_sniffer_set_filter(const struct esbSnifferFilter_s *filter);
 
 /**
- * @brief Start sniffer mode (continuous RX on pipes 0 and 1)
- * @param cb Callback invoked from ISR for each received packet
+ * @brief Keep the packets received with a CRC error in sniffer mode
+ *
+ * They are only stored with extended records, flagged with ESB_SNIFFER_RECORD_CRC_ERROR, and go
+ * through the filter like any other packet. Their length, pipe and payload may be wrong.
+ *
+ * @param enable true to keep the packets with a CRC error, false to drop them (default)
+ */
+void esb_sniffer_set_keep_crc_errors(bool enable);
+
+/**
+ * @brief Radio event counters
+ */
+struct esbRadioCounters_s {
+    uint32_t address;       // Address matches
+    uint32_t crc_ok;
+    uint32_t crc_error;
+    uint32_t rx_ready;      // RX starts, the sniffer restarts RX after each packet and hop
+};
+
+/**
+ * @brief Read the radio event counters
+ *
+ * The events are counted by hardware, with TIMER1 to TIMER4 in counter mode triggered by PPI,
+ * so that counting does not cost any interrupt. The counters are reset when sniffer, discovery
+ * or PRX mode is started and count in all modes.
+ *
+ * @param counters Filled up with the counter values
+ */
+void esb_get_radio_counters(struct esbRadioCounters_s *counters);
+
+/**
+ * @brief Get the radio time
+ *
+ * The radio time is a 64 bits monotonic time in microseconds, counted by TIMER0 since esb_init().
+ * The timestamps of the sniffer records are its 32 low bits.
+ *
+ * @return The radio time in microseconds
+ */
+uint64_t esb_get_time_us(void);
+
+/**
+ * @brief Number of targets in the link statistics, the least useful one is replaced by a new target
+ */
+#define ESB_LINK_STATS_TARGETS 32
+
+/**
+ * @brief Number of channels in the link statistics
+ */
+#define ESB_LINK_STATS_CHANNELS 101
+
+/**
+ * @brief Link statistics of the packets sent with ack enabled in PTX mode
+ */
+struct esbLinkStats_s {
+    uint32_t attempts;      // Packets sent, whatever the number of retries
+    uint32_t acks;          // Packets acked
+    uint16_t rssi_ewma;     // Exponential moving average of the ack RSSI, in 1/256 -dBm, 0 before the first ack
+    uint32_t last_ack_us;   // Radio time (32 low bits) of the last ack
+} __attribute__((packed));
+
+/**
+ * @brief Link statistics of a target, identified by its address
+ */
+struct esbTargetStats_s {
+    uint8_t address[5];
+    uint8_t channel;        // Channel of the last packet sent
+    struct esbLinkStats_s link;
+    uint16_t retry_histogram[16];   // Acked packets by number of retries, saturating
+} __attribute__((packed));
+
+/**
+ * @brief Get the link statistics of the targets
+ *
+ * @param stats Array of ESB_LINK_STATS_TARGETS entries, filled up with the targets in use
+ * @return Number of targets
+ */
+int esb_get_target_stats(struct esbTargetStats_s *stats);
+
+/**
+ * @brief Get the link statistics of the channels
+ *
+ * @param stats Array of ESB_LINK_STATS_CHANNELS entries, indexed by channel
+ */
+void esb_get_channel_stats(struct esbLinkStats_s *stats);
+
+/**
+ * @brief Clear the link statistics of all the targets and channels
+ */
+void esb_reset_link_stats(void);
+
+/**
+ * @brief Start sniffer mode (continuous RX on the pipes set by esb_set_sniffer_pipes())
+ *
+ * The receive ring is emptied and the drop count reset.
+ *
+ * @param cb Callback invoked from ISR each time a record is available
  */
 void esb_sniffer_start(esb_sniffer_rx_cb_t cb);
 
@@ -151,6 +458,70 @@ void esb_sniffer_start(esb_sniffer_rx_cb_t cb);
  */
 void esb_sniffer_stop(void);
 
+/**
+ * @brief Set the pipes to receive on in sniffer mode
+ * @param pipes Bitmask of enabled pipes, bit n enables pipe n. Pipes 0 and 1 by default.
+ */
+void esb_set_sniffer_pipes(uint8_t pipes);
+
+/**
+ * @brief Maximum number of channels in the sniffer hop table
+ */
+#define ESB_HOP_MAX_CHANNELS 16
+
+/**
+ * @brief Minimum sniffer hop dwell time, the radio needs up to 130us to ramp up in RX
+ */
+#define ESB_HOP_MIN_DWELL_US 200
+
+/**
+ * @brief Hop table flag: hop to the next channel after each received packet
+ */
+#define ESB_HOP_ON_PACKET 0x01
+
+/**
+ * @brief Set the channels the sniffer hops on, applied the next time sniffer or discovery mode is started
+ *
+ * The radio stays in RX and is retuned to the next channel of the table, in a loop, when the
+ * dwell time expires and, with ESB_HOP_ON_PACKET, after each received packet. The dwell time is
+ * counted by TIMER0 and the RX is stopped by PPI: a packet being received when the dwell time
+ * expires is received before hopping.
+ *
+ * @param channels Channels to hop on (0-100)
+ * @param count Number of channels, up to ESB_HOP_MAX_CHANNELS. 0 disables hopping.
+ * @param dwell_us Time spent on each channel, 0 to only hop on received packets. At least
+ *                 ESB_HOP_MIN_DWELL_US otherwise.
+ * @param flags ESB_HOP_* flags
+ * @return false if the table is not valid, the previous table is then kept
+ */
+bool esb_sniffer_set_hop_table(const uint8_t *channels, int count, uint32_t dwell_us, uint8_t flags);
+
+/**
+ * @brief Length of the raw frames received in discovery mode
+ *
+ * Long enough for a 5 bytes address, the 9 bits PCF, a 32 bytes payload and the 2 bytes CRC.
+ */
+#define ESB_DISCOVERY_FRAME_LENGTH (5 + 2 + 32 + 2)
+
+/**
+ * @brief Start discovery mode
+ *
+ * Discovery mode is a sniffer mode that receives packets without knowing their address: it
+ * matches the end of the carrier and the preamble that start every packet and stores the
+ * ESB_DISCOVERY_FRAME_LENGTH bytes that follow as raw records, without any CRC check.
+ * The address, CRC and length of the packet, if any, have to be found in the raw frame.
+ * Discovery mode is stopped with esb_sniffer_stop(), which restores the pipe addresses.
+ *
+ * @param cb Callback invoked from ISR each time a record is available
+ */
+void esb_discovery_start(esb_sniffer_rx_cb_t cb);
+
+/**
+ * @brief Check if discovery mode is currently active
+ * @return true if discovery is active
+ */
+bool esb_discovery_is_active(void);
+
 /**
  * @brief Send a no-ack broadcast packet while in sniffer mode
  *
@@ -170,7 +541,80 @@ bool esb_sniffer_send(struct esbPacket_s *packet, uint8_t address[5]);
 bool esb_sniffer_is_active(void);
 
 /**
- * @brief Set the address for pipe 1 (used by sniffer mode)
+ * @brief Number of radio pipes (logical addresses)
+ */
+#define ESB_NUM_PIPES 8
+
+/**
+ * @brief Set the address of a pipe (used by sniffer and PRX modes, and by PTX mode with esb_set_tx_pipe())
+ *
+ * Pipe 0 has its own address. Pipes 1 to 7 share the same 4 last address bytes (base address),
+ * setting the address of one of these pipes sets the base address for all of them.
+ *
+ * @param pipe Pipe number, from 0 to 7
  * @param address 5-byte address
  */
-void esb_set_address_pipe1(uint8_t address[5]);
+void esb_set_address_pipe(uint8_t pipe, uint8_t address[5]);
+
+/**
+ * @brief Select the pipe used to send, and to receive acks, in PTX mode
+ *
+ * Addresses preloaded with esb_set_address_pipe() can be switched between with a single
+ * register write. Pipes 1 to 7 share the same base address so up to 7 targets that only
+ * differ by their first address byte, plus any address on pipe 0, can be preloaded.
+ *
+ * @param pipe Pipe number, from 0 to 7
+ */
+void esb_set_tx_pipe(uint8_t pipe);
+
+/**
+ * @brief Set the pipes to receive on in PRX mode
+ * @param pipes Bitmask of enabled pipes, bit n enables pipe n
+ */
+void esb_set_rx_pipes(uint8_t pipes);
+
+/**
+ * @brief Maximum number of ack payloads queued per pipe in PRX mode
+ */
+#define ESB_ACK_PAYLOAD_QUEUE_DEPTH 4
+
+/**
+ * @brief Start PRX mode (continuous RX with automatic acks on the pipes set by esb_set_rx_pipes())
+ *
+ * Acks are sent by hardware right after a packet requesting an ack is received. They carry the
+ * payload at the head of the pipe ack payload queue, or are empty if the queue is empty. The
+ * payload is removed from the queue when the next packet, with a new PID, is received on the pipe.
+ * Retransmitted packets are acked but not reported.
+ *
+ * Received packets are stored in the same receive ring as in sniffer mode, which is emptied
+ * when PRX mode starts.
+ *
+ * @param cb Callback invoked from ISR each time a record is available
+ */
+void esb_prx_start(esb_sniffer_rx_cb_t cb);
+
+/**
+ * @brief Stop PRX mode and return radio to idle
+ */
+void esb_prx_stop(void);
+
+/**
+ * @brief Check if PRX mode is currently active
+ * @return true if PRX is active
+ */
+bool esb_prx_is_active(void);
+
+/**
+ * @brief Queue a payload to be sent in the next acks of a pipe in PRX mode
+ *
+ * @param pipe Pipe number, from 0 to 7
+ * @param data Ack payload
+ * @param length Payload length, from 0 to 32
+ * @return true if the payload has been queued, false if the pipe queue is full
+ */
+bool esb_prx_write_ack_payload(uint8_t pipe, const uint8_t *data, uint8_t length);
+
+/**
+ * @brief Empty the ack payload queues of all pipes
+ */
+void esb_prx_flush_ack_payloads(void);
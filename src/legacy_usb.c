@@ -12,6 +12,10 @@
 #include "fem.h"
 #include "led.h"
 #include "system.h"
+#include "swarm.h"
+#include "poll.h"
+#include "discovery.h"
+#include "usb_in.h"
 
 #define USB_ANSWER_MAX_LENGTH 128
 
@@ -32,14 +36,22 @@ char* command_type_name[] = {
 };
 
 struct data_command {
-    char payload[USB_ANSWER_MAX_LENGTH];
     uint32_t length;
+    // The OUT data is read in payload, which is also the payload of packet: a PTX packet is
+    // sent by the radio from the buffer it has been received in
+    union {
+        struct esbPacket_s packet;
+        struct {
+            uint8_t packet_header[offsetof(struct esbPacket_s, data)];
+            char payload[USB_ANSWER_MAX_LENGTH];
+        } __attribute__((packed));
+    };
 };
 
 struct setup_command {
     struct usb_setup_packet setup_packet;
     uint32_t length;
-    char data[16];
+    char data[32];
 };
 
 struct usb_command {
@@ -50,34 +62,178 @@ struct usb_command {
     };
 };
 
-K_MSGQ_DEFINE(command_queue, sizeof(struct usb_command), 10, 4);
-K_MSGQ_DEFINE(sniffer_queue, sizeof(struct esbSnifferPacket_s), 8, 4);
+// Radio packet in flight between usb_thread and usb_answer_thread
+struct tx_context {
+    struct esbTxDesc_s desc;
+    struct esbPacket_s *packet;
+    // Command buffer holding the packet, released once the packet has been answered. NULL
+    // when the buffer is released by the context of another packet it holds.
+    struct usb_command *command;
+    struct esbPacket_s ack;
+    // Settings used when the packet was queued, they define the answer format
+    bool answer;
+    bool inline_mode;
+    bool inline_rssi_mode;
+    bool ack_enabled;
+    bool invalid_settings;
+};
+
+// Commands are passed by pointer from the USB callbacks to usb_thread, the queue can hold all the buffers
+#define COMMAND_BUFFER_COUNT 12
+K_MEM_SLAB_DEFINE(command_slab, sizeof(struct usb_command), COMMAND_BUFFER_COUNT, 4);
+K_MSGQ_DEFINE(command_queue, sizeof(struct usb_command *), COMMAND_BUFFER_COUNT, 4);
+// Buffers that OUT data cannot take, so that control requests are still accepted when it fills up the pool
+#define COMMAND_SETUP_RESERVE 2
+// Set when the OUT endpoint has been left NAKing the host for lack of buffer
+static atomic_t out_paused;
+K_SEM_DEFINE(sniffer_rx_sem, 0, 1);
+// Given when the scan job ends, GET_SCAN_CHANNELS waits on it for the scan started by
+// START_SCAN_CHANNELS
+K_SEM_DEFINE(scan_done_sem, 0, 1);
+static atomic_t channel_scan_pending;
+// Longest wait of GET_SCAN_CHANNELS, a full scan with 15 retries takes about one second
+#define CHANNEL_SCAN_TIMEOUT K_SECONDS(3)
+
+K_MEM_SLAB_DEFINE(tx_context_slab, sizeof(struct tx_context), ESB_TX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(tx_done_queue, sizeof(struct tx_context *), ESB_TX_QUEUE_DEPTH, 4);
 
 K_MUTEX_DEFINE(usb_radio_mutex);
 
-static atomic_t sniffer_drop_count;
 
-static void fw_scan(uint8_t start, uint8_t stop, char* data, int data_length);
+static void scan_step(void);
+static void spectrum_step(void);
 static void handle_vendor_command(struct setup_command* setup);
 
+// Radio mode values
+#define RADIO_MODE_PTX 0
+#define RADIO_MODE_SNIFFER 1
+#define RADIO_MODE_PRX 2
+#define RADIO_MODE_SWARM 3
+#define RADIO_MODE_POLL 4
+#define RADIO_MODE_DISCOVERY 5
+#define RADIO_MODE_SPECTRUM 6
+
+// Sniffer format flags
+#define SNIFFER_FORMAT_RECORD 0
+#define SNIFFER_FORMAT_AGGREGATED 0x01
+#define SNIFFER_FORMAT_EXTENDED 0x02
+#define SNIFFER_FORMAT_CRC_ERRORS 0x04
+
+#define SNIFFER_AGGREGATE_BUFFER_SIZE 512
+
+// Records waiting to be sent in aggregated sniffer format
+static struct {
+    uint8_t buffer[SNIFFER_AGGREGATE_BUFFER_SIZE];
+    int length;
+    // Radio time (32 low bits) at which the first record in the buffer has been received
+    uint32_t first_record_us;
+} sniffer_aggregate;
+
+// Stream events, sent on the stream endpoint when it is enabled: length(1) + type(1) + data
+#define STREAM_EVENT_SCAN_FOUND 0x01
+#define STREAM_EVENT_SCAN_DONE 0x02
+#define STREAM_EVENT_FLEET_FOUND 0x03
+
+// Fleet scan datarate flags
+#define FLEET_SCAN_1M 0x01
+#define FLEET_SCAN_2M 0x02
+// Skip the targets found by the previous fleet scan, and keep its records
+#define FLEET_SCAN_CONTINUE 0x80
+
+#define FLEET_SCAN_MAX_RECORDS 48
+
+// Target that acked during a fleet scan
+struct fleet_record {
+    uint8_t channel;
+    uint8_t datarate;       // Same values as SET_DATA_RATE
+    uint8_t address[5];
+    uint8_t rssi;
+    uint8_t retry;
+    uint8_t ack_length;
+} __attribute__((packed));
+
+// Scan running in the background, one probe per usb_thread round in PTX mode. A channel scan
+// probes one target. A fleet scan sweeps channels, datarates and a range of address suffixes
+// (the last address byte), the channel changing first. Once a target has acked, its other
+// channels and datarates are skipped.
+static struct {
+    bool running;
+    bool fleet;
+    uint8_t address[5];
+    uint8_t start_channel;
+    uint8_t stop_channel;
+    uint8_t datarates;      // FLEET_SCAN_1M and/or FLEET_SCAN_2M
+    uint8_t last_suffix;
+    struct esbPacket_s packet;
+    // Next probe
+    uint8_t channel;
+    uint8_t datarate;       // FLEET_SCAN_1M or FLEET_SCAN_2M
+    uint8_t suffix;
+    // Channel scan results
+    uint8_t found_count;
+    uint8_t found[101];
+    // Fleet scan results
+    uint8_t record_count;
+    struct fleet_record records[FLEET_SCAN_MAX_RECORDS];
+    uint32_t found_targets[256 / 32];
+} scan_job;
+
+#define SPECTRUM_CHANNEL_COUNT 101
+#define SPECTRUM_MAX_INTERVAL_US 1000
+
+// Spectrum sweep, sent in one transfer
+struct spectrum_sweep {
+    uint32_t index;             // Sweep counter, little endian
+    uint32_t timestamp_us;      // Radio time at the start of the sweep, little endian
+    uint8_t channel_count;
+    struct esbRssiStats_s channels[SPECTRUM_CHANNEL_COUNT];
+} __attribute__((packed));
+
+// Longest measurement of one usb_thread round, the commands are handled between two rounds
+#define SPECTRUM_MAX_STEP_US 10000
+
+// Spectrum mode: all the channels are measured in turn, in one usb_thread round or, with slow
+// samples, in several
+static struct {
+    uint8_t samples;
+    uint16_t interval_us;
+    uint8_t channel;
+    // Samples of the current channel taken in the previous rounds
+    uint8_t sample;
+    uint8_t min;
+    uint8_t max;
+    uint32_t sum;
+    uint32_t sweep_count;
+    struct spectrum_sweep sweep;
+} spectrum = {
+    .samples = 8,
+    .interval_us = 10,
+};
+
 // state
 static struct {
     uint8_t datarate;
 	uint8_t channel;
     bool ack_enabled;
-    uint8_t scan_result[ESB_MAX_PAYLOAD_LENGTH];
-    int scan_result_length;
+    uint8_t address[5];
+    uint8_t tx_pipe;
+    uint8_t arc;
     bool inline_mode;
     bool inline_rssi_mode;
-    bool sniffer_mode;
-    char usb_answer[USB_ANSWER_MAX_LENGTH];
+    uint8_t radio_mode;
+    uint8_t sniffer_format;
+    uint16_t sniffer_latency_ms;
+    bool separate_stream;
 } state = {
     .datarate = 2,
 	.channel = 42,
     .ack_enabled = true,
+    .address = {0xe7, 0xe7, 0xe7, 0xe7, 0xe7},
+    .arc = 3,
     .inline_mode = false,
     .inline_rssi_mode = false,
-    .sniffer_mode = false,
+    .radio_mode = RADIO_MODE_PTX,
+    .sniffer_format = SNIFFER_FORMAT_RECORD,
 };
 
 // Inline mode out header
@@ -112,9 +268,11 @@ typedef struct {
     uint8_t rssi_dbm;
 } __attribute__((packed)) inline_rssi_mode_in_header;
 
-#define CRAZYRADIO_NUM_EP 2
+#define CRAZYRADIO_NUM_EP 3
 #define CRAZYRADIO_OUT_EP_ADDR 0x01
 #define CRAZYRADIO_IN_EP_ADDR 0x81
+// Carries the streamed data when selected with SET_STREAM_ENDPOINT, see stream_endpoint()
+#define CRAZYRADIO_STREAM_EP_ADDR 0x82
 #define CRAZYRADIO_BULK_EP_MPS 64
 
 #define INITIALIZER_IF(num_ep, iface_class)				\
@@ -144,6 +302,7 @@ USBD_CLASS_DESCR_DEFINE(primary, 0) struct {
     struct usb_if_descriptor if0;
 	struct usb_ep_descriptor if0_in_ep;
 	struct usb_ep_descriptor if0_out_ep;
+	struct usb_ep_descriptor if0_stream_ep;
 } __packed crazyradio_desc = {
 	/* Interface descriptor 0 */
 	.if0 = INITIALIZER_IF(CRAZYRADIO_NUM_EP, USB_BCC_VENDOR),
@@ -151,63 +310,141 @@ USBD_CLASS_DESCR_DEFINE(primary, 0) struct {
 				       CRAZYRADIO_BULK_EP_MPS, 0),
 	.if0_in_ep = INITIALIZER_IF_EP(CRAZYRADIO_IN_EP_ADDR, USB_DC_EP_BULK,
 				       CRAZYRADIO_BULK_EP_MPS, 0),
+	.if0_stream_ep = INITIALIZER_IF_EP(CRAZYRADIO_STREAM_EP_ADDR, USB_DC_EP_BULK,
+				       CRAZYRADIO_BULK_EP_MPS, 0),
 };
 
-static void sniffer_rx_callback(const struct esbSnifferPacket_s *pkt)
+// Data for the host is sent asynchronously, in order. The radio can work on the next packet
+// while the answer to the previous one is being sent.
+#define USB_IN_BUFFER_COUNT 4
+USB_IN_ENDPOINT_DEFINE(usb_in, CRAZYRADIO_IN_EP_ADDR, USB_IN_BUFFER_COUNT);
+USB_IN_ENDPOINT_DEFINE(usb_stream, CRAZYRADIO_STREAM_EP_ADDR, USB_IN_BUFFER_COUNT);
+// How long the swarm and poll threads wait for an IN buffer before dropping their data. Bounded
+// so that a host that stops reading cannot keep swarm_stop() or poll_stop() waiting forever.
+#define STREAM_WRITE_TIMEOUT K_MSEC(100)
+
+BUILD_ASSERT(SNIFFER_AGGREGATE_BUFFER_SIZE <= USB_IN_BUFFER_SIZE);
+BUILD_ASSERT(SWARM_RESULT_BUFFER_SIZE <= USB_IN_BUFFER_SIZE);
+BUILD_ASSERT(POLL_RESULT_BUFFER_SIZE <= USB_IN_BUFFER_SIZE);
+BUILD_ASSERT(sizeof(struct spectrum_sweep) <= USB_IN_BUFFER_SIZE);
+
+// Endpoint of the streamed data: sniffer, PRX and discovery records, swarm results and poll
+// downlinks. The radio modes are exclusive, so they are never sent while PTX answers are: on
+// their own endpoint, the PTX answers are never queued behind data left over from another mode.
+static struct usbInEndpoint_s *stream_endpoint(void)
+{
+    return state.separate_stream ? &usb_stream : &usb_in;
+}
+
+static void swarm_result_callback(const uint8_t *data, int length)
 {
-    if (k_msgq_put(&sniffer_queue, pkt, K_NO_WAIT) != 0) {
-        atomic_inc(&sniffer_drop_count);
+    // Aggregated results can be larger than one USB packet
+    if (!usb_in_write(stream_endpoint(), data, length, STREAM_WRITE_TIMEOUT)) {
+        LOG_WRN("Swarm result dropped, the host is not reading");
     }
 }
 
-void crazyradio_out_cb(uint8_t ep, enum usb_dc_ep_cb_status_code cb_status)
+static void poll_downlink_callback(const uint8_t *data, int length)
 {
-    uint32_t bytes_to_read;
-    static struct usb_command command;
-    static bool accumulating = false;
+    if (!usb_in_write(stream_endpoint(), data, length, STREAM_WRITE_TIMEOUT)) {
+        LOG_WRN("Poll downlinks dropped, the host is not reading");
+    }
+}
 
-    usb_read(ep, NULL, 0, &bytes_to_read);
+static void sniffer_rx_callback(void)
+{
+    k_sem_give(&sniffer_rx_sem);
+}
 
-    if (accumulating) {
-        uint32_t offset = command.data.length;
-        uint32_t space = sizeof(command.data.payload) - offset;
-        if (bytes_to_read <= space) {
-            usb_read(ep, &command.data.payload[offset], bytes_to_read, NULL);
-            command.data.length += bytes_to_read;
-        } else {
-            usb_read(ep, &command.data.payload[offset], space, NULL);
-            command.data.length += space;
-            uint8_t scratch[CRAZYRADIO_BULK_EP_MPS];
-            usb_read(ep, scratch, bytes_to_read - space, NULL);
-        }
-        if (bytes_to_read < CRAZYRADIO_BULK_EP_MPS) {
-            accumulating = false;
-            k_msgq_put(&command_queue, &command, K_FOREVER);
+// Allocate a buffer for OUT data, without taking the buffers reserved for control requests
+static struct usb_command *command_alloc_data(void)
+{
+    struct usb_command *command;
+
+    if (k_mem_slab_num_free_get(&command_slab) <= COMMAND_SETUP_RESERVE ||
+        k_mem_slab_alloc(&command_slab, (void **)&command, K_NO_WAIT) != 0) {
+        return NULL;
+    }
+
+    // The buffer holds whatever its previous user left in it
+    command->type = command_data;
+    command->data.length = 0;
+
+    return command;
+}
+
+// Read the packet waiting on the OUT endpoint. Called from the USB stack, and from
+// out_resume_work once a buffer has been released: the endpoint is NAKing the host then, so
+// no callback can run at the same time.
+static void out_read(uint8_t ep)
+{
+    uint32_t bytes_to_read;
+    // Command being received, a transfer can span several USB packets
+    static struct usb_command *command = NULL;
+
+    while (command == NULL && (command = command_alloc_data()) == NULL) {
+        // Out of buffers: the packet is left unread, so the endpoint NAKs the host until
+        // command_release() resumes reading. The USB stack is never blocked.
+        atomic_set(&out_paused, 1);
+        // Unless a buffer has been released before the flag was set
+        if (k_mem_slab_num_free_get(&command_slab) <= COMMAND_SETUP_RESERVE ||
+            !atomic_cas(&out_paused, 1, 0)) {
+            return;
         }
-        return;
     }
 
-    command.type = command_data;
-    if (bytes_to_read > sizeof(command.data.payload)) {
-        usb_read(ep, command.data.payload, sizeof(command.data.payload), NULL);
-        uint8_t scratch[CRAZYRADIO_BULK_EP_MPS];
-        usb_read(ep, scratch, bytes_to_read - sizeof(command.data.payload), NULL);
-        command.data.length = sizeof(command.data.payload);
+    usb_dc_ep_read_wait(ep, NULL, 0, &bytes_to_read);
+
+    uint32_t offset = command->data.length;
+    uint32_t space = sizeof(command->data.payload) - offset;
+    if (bytes_to_read <= space) {
+        usb_dc_ep_read_wait(ep, &command->data.payload[offset], bytes_to_read, NULL);
+        command->data.length += bytes_to_read;
     } else {
-        usb_read(ep, command.data.payload, bytes_to_read, NULL);
-        command.data.length = bytes_to_read;
+        usb_dc_ep_read_wait(ep, &command->data.payload[offset], space, NULL);
+        command->data.length += space;
+        uint8_t scratch[CRAZYRADIO_BULK_EP_MPS];
+        usb_dc_ep_read_wait(ep, scratch, bytes_to_read - space, NULL);
     }
 
-    if (bytes_to_read == CRAZYRADIO_BULK_EP_MPS) {
-        accumulating = true;
-        return;
+    // The transfer ends with a packet shorter than the max packet size
+    if (bytes_to_read < CRAZYRADIO_BULK_EP_MPS) {
+        // Cannot block: the queue can hold all the buffers
+        k_msgq_put(&command_queue, &command, K_NO_WAIT);
+        command = NULL;
+    }
+
+    // Accept the next packet only once the state above is up to date
+    usb_dc_ep_read_continue(ep);
+}
+
+void crazyradio_out_cb(uint8_t ep, enum usb_dc_ep_cb_status_code cb_status)
+{
+    out_read(ep);
+}
+
+static void out_resume_handler(struct k_work *work)
+{
+    out_read(CRAZYRADIO_OUT_EP_ADDR);
+}
+
+K_WORK_DEFINE(out_resume_work, out_resume_handler);
+
+// Release a command buffer, and resume reading the OUT endpoint if it was waiting for one.
+// The endpoint is read from the work queue so that the radio threads never run USB code.
+static void command_release(struct usb_command *command)
+{
+    k_mem_slab_free(&command_slab, command);
+
+    if (k_mem_slab_num_free_get(&command_slab) > COMMAND_SETUP_RESERVE && atomic_cas(&out_paused, 1, 0)) {
+        k_work_submit(&out_resume_work);
     }
-    k_msgq_put(&command_queue, &command, K_FOREVER);
 }
 
 void crazyradio_in_cb(uint8_t ep, enum usb_dc_ep_cb_status_code cb_status)
 {
-	// Nop
+	// Progresses the transfers started by usb_in_write()
+	usb_transfer_ep_callback(ep, cb_status);
 }
 
 static struct usb_ep_cfg_data ep_cfg[] = {
@@ -219,6 +456,10 @@ static struct usb_ep_cfg_data ep_cfg[] = {
 		.ep_cb = crazyradio_in_cb,
 		.ep_addr = CRAZYRADIO_IN_EP_ADDR,
 	},
+	{
+		.ep_cb = crazyradio_in_cb,
+		.ep_addr = CRAZYRADIO_STREAM_EP_ADDR,
+	},
 };
 
 //Vendor control messages and commands
@@ -236,7 +477,29 @@ static struct usb_ep_cfg_data ep_cfg[] = {
 #define SET_RADIO_MODE 0x24
 #define SET_SNIFFER_ADDRESS 0x25
 #define GET_SNIFFER_DROP_COUNT 0x26
+#define SET_RX_PIPES 0x27
+#define SET_SNIFFER_FORMAT 0x28
+#define SET_SNIFFER_FILTER 0x29
+#define SET_SNIFFER_PIPES 0x2A
+#define GET_DISCOVERY_RESULTS 0x2B
+#define SET_SNIFFER_HOP_TABLE 0x2C
+#define GET_RADIO_COUNTERS 0x2D
 #define SET_PACKET_LOSS_SIMULATION 0x30
+#define SET_SWARM_TARGET 0x40
+#define CLEAR_SWARM_TARGETS 0x41
+#define SET_SWARM_PERIOD 0x42
+#define SET_POLL_INTERVAL 0x43
+#define SET_RADIO_TX_PIPE 0x44
+#define GET_RADIO_TIME 0x45
+#define SET_STREAM_ENDPOINT 0x46
+#define START_SCAN 0x47
+#define GET_SCAN_PROGRESS 0x48
+#define GET_SCAN_RESULTS 0x49
+#define START_FLEET_SCAN 0x4A
+#define GET_FLEET_SCAN_RESULTS 0x4B
+#define SET_SPECTRUM_CONFIG 0x4C
+#define GET_LINK_STATS 0x4D
+#define RESET_LINK_STATS 0x4E
 #define RESET_TO_BOOTLOADER 0xff
 
 // Inline mode values
@@ -260,8 +523,6 @@ static int crazyradio_vendor_handler(struct usb_setup_packet *setup,
 	LOG_DBG("Class request: bRequest 0x%x bmRequestType 0x%x len %d",
 		setup->bRequest, setup->bmRequestType, *len);
 
-    static struct usb_command command;
-
 	if (USB_REQTYPE_GET_TYPE(setup->bmRequestType) == USB_REQTYPE_TYPE_VENDOR) {
         LOG_DBG("Vendor request: bRequest 0x%x bmRequestType 0x%x len %d",
                 setup->bRequest, setup->bmRequestType, *len);
@@ -277,41 +538,139 @@ static int crazyradio_vendor_handler(struct usb_setup_packet *setup,
             setup->bRequest == SET_MODE ||
             (setup->bRequest == SET_INLINE_MODE && setup->wValue <= INLINE_MODE_ON_WITH_RSSI) ||
             setup->bRequest == SET_SNIFFER_ADDRESS ||
-            (setup->bRequest == SET_RADIO_MODE && setup->wValue <= 1) ||
+            (setup->bRequest == SET_RADIO_MODE && setup->wValue <= RADIO_MODE_SPECTRUM) ||
+            setup->bRequest == SET_RX_PIPES ||
+            (setup->bRequest == SET_SNIFFER_FORMAT && setup->wValue <= (SNIFFER_FORMAT_AGGREGATED | SNIFFER_FORMAT_EXTENDED | SNIFFER_FORMAT_CRC_ERRORS)) ||
+            setup->bRequest == SET_SNIFFER_FILTER ||
+            setup->bRequest == SET_SNIFFER_PIPES ||
+            (setup->bRequest == SET_SNIFFER_HOP_TABLE && setup->wLength <= ESB_HOP_MAX_CHANNELS) ||
+            setup->bRequest == SET_SWARM_TARGET ||
+            setup->bRequest == CLEAR_SWARM_TARGETS ||
+            setup->bRequest == SET_SWARM_PERIOD ||
+            setup->bRequest == SET_POLL_INTERVAL ||
+            (setup->bRequest == SET_RADIO_TX_PIPE && setup->wValue < ESB_NUM_PIPES) ||
+            (setup->bRequest == SET_STREAM_ENDPOINT && setup->wValue <= 1) ||
+            (setup->bRequest == SET_SPECTRUM_CONFIG && setup->wValue >= 1 && setup->wValue <= 255 &&
+             setup->wIndex <= SPECTRUM_MAX_INTERVAL_US) ||
+            (setup->bRequest == CHANNEL_SCANN && usb_reqtype_is_to_device(setup)) ||
+            (setup->bRequest == START_SCAN && setup->wLength <= 32 && setup->wValue <= setup->wIndex && setup->wIndex <= 100) ||
+            // wValue: start and stop channels, wIndex: first and last suffixes, data: flags(1) + address(5) + packet(1-26)
+            (setup->bRequest == START_FLEET_SCAN && setup->wLength > 6 && setup->wLength <= 32 &&
+             (setup->wValue & 0xff) <= (setup->wValue >> 8) && (setup->wValue >> 8) <= 100 &&
+             (setup->wIndex & 0xff) <= (setup->wIndex >> 8)) ||
             setup->bRequest == SET_PACKET_LOSS_SIMULATION) {
             
             LOG_DBG("Queuing command %d", setup->bRequest);
 
 
-            command.type = command_setup;
+            struct usb_command *command;
+            if (k_mem_slab_alloc(&command_slab, (void **)&command, K_NO_WAIT) != 0) {
+                // Stalled instead of blocking the USB stack, the host can retry
+                LOG_WRN("No buffer for request 0x%x", setup->bRequest);
+                return -ENOMEM;
+            }
+            command->type = command_setup;
+            command->setup.length = 0;
             uint32_t length = *len;
-            memcpy(&command.setup.setup_packet, setup, sizeof(struct usb_setup_packet));
-            if (length > sizeof(command.setup.data)) {
-                length = sizeof(command.setup.data);
+            memcpy(&command->setup.setup_packet, setup, sizeof(struct usb_setup_packet));
+            if (length > sizeof(command->setup.data)) {
+                length = sizeof(command->setup.data);
             }
             if (usb_reqtype_is_to_device(setup) && length > 0)
             {
-                memcpy(command.setup.data, *data, length);
-                command.setup.length = length;
+                memcpy(command->setup.data, *data, length);
+                command->setup.length = length;
             }
-            k_msgq_put(&command_queue, &command, K_FOREVER);
+            if (setup->bRequest == CHANNEL_SCANN) {
+                // Before queuing, so that the end of the scan cannot be missed
+                k_sem_reset(&scan_done_sem);
+                atomic_set(&channel_scan_pending, 1);
+            }
+            k_msgq_put(&command_queue, &command, K_NO_WAIT);
         } 
-        else if (setup->bRequest == CHANNEL_SCANN && usb_reqtype_is_to_device(setup)) {
-            k_mutex_lock(&usb_radio_mutex, K_FOREVER);
-            uint8_t start = setup->wValue;
-            uint8_t stop = setup->wIndex;
-            fw_scan(start, stop, *data, setup->wLength);
-            k_mutex_unlock(&usb_radio_mutex);
-        } else if (setup->bRequest == CHANNEL_SCANN && usb_reqtype_is_to_host(setup)) {
-            *data = state.scan_result;
-            *len = MIN(state.scan_result_length, setup->wLength);
+        else if (setup->bRequest == CHANNEL_SCANN && usb_reqtype_is_to_host(setup)) {
+            // The scan runs in usb_thread, the data stage is only held until it ends. Nothing
+            // is locked while waiting, so the PTX traffic and the scan keep going.
+            if (atomic_cas(&channel_scan_pending, 1, 0) &&
+                k_sem_take(&scan_done_sem, CHANNEL_SCAN_TIMEOUT) != 0) {
+                LOG_WRN("Channel scan not done in time, returning the channels found so far");
+            }
+            // More than 63 bytes means that no channel has been found for some hosts
+            *data = scan_job.found;
+            *len = MIN(scan_job.found_count, MIN(setup->wLength, 63));
         }
         else if (setup->bRequest == GET_SNIFFER_DROP_COUNT && usb_reqtype_is_to_host(setup)) {
             static uint32_t drop_count_le;
-            drop_count_le = sys_cpu_to_le32(atomic_get(&sniffer_drop_count));
+            if (state.radio_mode == RADIO_MODE_POLL) {
+                drop_count_le = sys_cpu_to_le32(poll_get_drop_count());
+            } else {
+                drop_count_le = sys_cpu_to_le32(esb_sniffer_get_drop_count());
+            }
             *data = (uint8_t *)&drop_count_le;
             *len = MIN(4, setup->wLength);
         }
+        else if (setup->bRequest == GET_SCAN_PROGRESS && usb_reqtype_is_to_host(setup)) {
+            // Updated by usb_thread, a scan step can end while this is copied
+            static uint8_t progress[6];
+            progress[0] = scan_job.running;
+            progress[1] = scan_job.channel;
+            progress[2] = scan_job.stop_channel;
+            progress[3] = scan_job.fleet ? scan_job.record_count : scan_job.found_count;
+            progress[4] = scan_job.suffix;
+            progress[5] = (scan_job.datarate == FLEET_SCAN_1M) ? 1 : 2;
+            *data = progress;
+            *len = MIN(sizeof(progress), setup->wLength);
+        }
+        else if (setup->bRequest == GET_SCAN_RESULTS && usb_reqtype_is_to_host(setup)) {
+            *data = scan_job.found;
+            *len = MIN(scan_job.found_count, setup->wLength);
+        }
+        else if (setup->bRequest == GET_FLEET_SCAN_RESULTS && usb_reqtype_is_to_host(setup)) {
+            *data = (uint8_t *)scan_job.records;
+            *len = MIN(scan_job.record_count * sizeof(struct fleet_record), setup->wLength);
+        }
+        else if (setup->bRequest == GET_RADIO_TIME && usb_reqtype_is_to_host(setup)) {
+            // The host maps it to the middle of the control transfer
+            static uint64_t time_le;
+            time_le = sys_cpu_to_le64(esb_get_time_us());
+            *data = (uint8_t *)&time_le;
+            *len = MIN(sizeof(time_le), setup->wLength);
+        }
+        else if (setup->bRequest == GET_RADIO_COUNTERS && usb_reqtype_is_to_host(setup)) {
+            static uint32_t counters_le[4];
+            struct esbRadioCounters_s counters;
+            esb_get_radio_counters(&counters);
+            counters_le[0] = sys_cpu_to_le32(counters.address);
+            counters_le[1] = sys_cpu_to_le32(counters.crc_ok);
+            counters_le[2] = sys_cpu_to_le32(counters.crc_error);
+            counters_le[3] = sys_cpu_to_le32(counters.rx_ready);
+            *data = (uint8_t *)counters_le;
+            *len = MIN(sizeof(counters_le), setup->wLength);
+        }
+        else if (setup->bRequest == GET_DISCOVERY_RESULTS && usb_reqtype_is_to_host(setup)) {
+            static struct discoveryResult_s results[DISCOVERY_MAX_RESULTS];
+            int count = discovery_get_results(results);
+            *data = (uint8_t *)results;
+            *len = MIN(count * sizeof(struct discoveryResult_s), setup->wLength);
+        }
+        else if (setup->bRequest == GET_LINK_STATS && usb_reqtype_is_to_host(setup) && setup->wValue <= 1) {
+            // wValue: 0 for the targets, 1 for the channels. Copied so that the transfer is consistent.
+            static union {
+                struct esbTargetStats_s targets[ESB_LINK_STATS_TARGETS];
+                struct esbLinkStats_s channels[ESB_LINK_STATS_CHANNELS];
+            } link_stats;
+            if (setup->wValue == 0) {
+                int count = esb_get_target_stats(link_stats.targets);
+                *len = MIN(count * sizeof(struct esbTargetStats_s), setup->wLength);
+            } else {
+                esb_get_channel_stats(link_stats.channels);
+                *len = MIN(sizeof(link_stats.channels), setup->wLength);
+            }
+            *data = (uint8_t *)&link_stats;
+        }
+        else if (setup->bRequest == RESET_LINK_STATS && !usb_reqtype_is_to_host(setup)) {
+            esb_reset_link_stats();
+        }
         else if (setup->bRequest == RESET_TO_BOOTLOADER) {
             LOG_DBG("Vendor request: RESET_TO_BOOTLOADER");
             system_reset_to_uf2();
@@ -328,7 +687,10 @@ static int crazyradio_vendor_handler(struct usb_setup_packet *setup,
 
 void crazyradio_status_cb(struct usb_cfg_data * data, enum usb_dc_status_code cb_status, const uint8_t *param)
 {
-	;
+	if (cb_status == USB_DC_RESET || cb_status == USB_DC_DISCONNECTED) {
+		usb_in_cancelled(&usb_in);
+		usb_in_cancelled(&usb_stream);
+	}
 }
 
 void crazyradio_interface_config(struct usb_desc_header *head, uint8_t bInterfaceNumber)
@@ -354,267 +716,579 @@ USBD_DEFINE_CFG_DATA(crazyradio_config) = {
 #define USB_THREAD_PRIORITY 5
 
 static void usb_thread(void *, void *, void *);
+static void usb_answer_thread(void *, void *, void *);
 
 K_THREAD_DEFINE(usb_tid, USB_THREAD_STACK_SIZE,
                 usb_thread, NULL, NULL, NULL,
                 USB_THREAD_PRIORITY, 0, 0);
 
+K_THREAD_DEFINE(usb_answer_tid, USB_THREAD_STACK_SIZE,
+                usb_answer_thread, NULL, NULL, NULL,
+                USB_THREAD_PRIORITY, 0, 0);
+
+static void tx_done(struct esbTxDesc_s *desc)
+{
+    struct tx_context *ctx = CONTAINER_OF(desc, struct tx_context, desc);
+
+    // Cannot fail: there are never more contexts than the queue can hold
+    k_msgq_put(&tx_done_queue, &ctx, K_NO_WAIT);
+}
+
+static void queue_packet(struct tx_context *ctx)
+{
+    ctx->desc.packet = ctx->packet;
+    ctx->desc.ack = &ctx->ack;
+    ctx->ack.length = 0;
+
+    if (ctx->invalid_settings || !esb_submit(&ctx->desc, tx_done)) {
+        // Not sent, answer once the previously queued packets have been answered
+        esb_flush();
+        ctx->desc.acked = false;
+        ctx->desc.rssi = 0;
+        ctx->desc.retry = 0;
+        k_msgq_put(&tx_done_queue, &ctx, K_FOREVER);
+    }
+}
+
+static void send_answer(struct tx_context *ctx)
+{
+    static char usb_answer[USB_ANSWER_MAX_LENGTH];
+    bool acked = ctx->desc.acked;
+    uint8_t rssi = ctx->desc.rssi;
+    uint8_t arc_counter = ctx->desc.retry;
+    struct esbPacket_s *ack = &ctx->ack;
+
+    if (!ctx->answer) {
+        return;
+    }
+
+    if (!ctx->invalid_settings) {
+        if (acked || !ctx->ack_enabled) {
+            led_pulse_green(K_MSEC(50));
+        } else {
+            led_pulse_red(K_MSEC(50));
+        }
+
+        if (ack->length > 32) {
+            LOG_ERR("Got an ack of size %d!", ack->length);
+            ack->length = 32;
+        }
+
+        if (ctx->inline_mode && !ctx->inline_rssi_mode) {
+            // Prepare the inline mode header
+            inline_mode_in_header *usb_header = (inline_mode_in_header *)usb_answer;
+            memset(usb_header, 0, sizeof(inline_mode_in_header));
+            usb_header->length = ack->length + sizeof(inline_mode_in_header);
+            usb_header->ack_received = acked ? 1 : 0;
+            if (ctx->ack_enabled) usb_header->rssi_lt_64dbm = (rssi < 64) ? 1 : 0;
+            if (ctx->ack_enabled) usb_header->arc_counter = arc_counter & 0x0f;
+
+            // Shift the ack data
+            if (acked && ack->length > 0) {
+                memcpy(&usb_answer[sizeof(inline_mode_in_header)], ack->data, ack->length);
+            }
+
+            usb_in_write(&usb_in, usb_answer, usb_header->length, K_FOREVER);
+        } else if (ctx->inline_mode && ctx->inline_rssi_mode) {
+            // Prepare the inline with rssi mode header
+            inline_rssi_mode_in_header *usb_header = (inline_rssi_mode_in_header *)usb_answer;
+            memset(usb_header, 0, sizeof(inline_rssi_mode_in_header));
+            usb_header->length = ack->length + sizeof(inline_rssi_mode_in_header);
+            usb_header->ack_received = acked ? 1 : 0;
+            if (ctx->ack_enabled) usb_header->rssi_lt_64dbm = (rssi < 64) ? 1 : 0;
+            if (ctx->ack_enabled) usb_header->arc_counter = arc_counter & 0x0f;
+            usb_header->rssi_dbm = rssi;
+
+            // Shift the ack data
+            if (acked && ack->length > 0) {
+                memcpy(&usb_answer[sizeof(inline_rssi_mode_in_header)], ack->data, ack->length);
+            }
+
+            usb_in_write(&usb_in, usb_answer, usb_header->length, K_FOREVER);
+        } else {
+            if (!ctx->ack_enabled) {
+                led_pulse_green(K_MSEC(50));
+            } else if (acked && ack->length <= 32) {
+                usb_answer[0] = (arc_counter & 0x0f) << 4 | (rssi < 64)<<1 | 1;
+                memcpy(&usb_answer[1], ack->data, ack->length);
+
+                usb_in_write(&usb_in, usb_answer, ack->length + 1, K_FOREVER);
+            } else {
+                char no_ack_answer[1] = {0};
+
+                usb_in_write(&usb_in, no_ack_answer, 1, K_FOREVER);
+            }
+        }
+    } else {
+        LOG_DBG("Not sending, radio settings not handled!");
+        if (ctx->inline_mode && !ctx->inline_rssi_mode) {
+            // Prepare the inline mode header
+            inline_mode_in_header invalid_settings_header = {
+                .length = sizeof(inline_mode_in_header),
+                .ack_received = 0,
+                .rssi_lt_64dbm = 0,
+                .invalid_settings = 1,
+                .arc_counter = 0,
+            };
+
+            usb_in_write(&usb_in, &invalid_settings_header, invalid_settings_header.length, K_FOREVER);
+        } else if (ctx->inline_mode && ctx->inline_rssi_mode) {
+            // Prepare the inline with rssi mode header
+            inline_rssi_mode_in_header invalid_settings_header = {
+                .length = sizeof(inline_rssi_mode_in_header),
+                .ack_received = 0,
+                .rssi_lt_64dbm = 0,
+                .invalid_settings = 1,
+                .arc_counter = 0,
+                .rssi_dbm = 0,
+            };
+
+            usb_in_write(&usb_in, &invalid_settings_header, invalid_settings_header.length, K_FOREVER);
+        } else {
+            char no_ack_answer[1] = {0};
+
+            usb_in_write(&usb_in, no_ack_answer, 1, K_FOREVER);
+        }
+
+        led_pulse_red(K_MSEC(50));
+    }
+}
+
+static void usb_answer_thread(void *, void *, void *) {
+    struct tx_context *ctx;
+
+    while(1) {
+        k_msgq_get(&tx_done_queue, &ctx, K_FOREVER);
+        send_answer(ctx);
+        if (ctx->command) {
+            command_release(ctx->command);
+        }
+        k_mem_slab_free(&tx_context_slab, ctx);
+    }
+}
+
+// Send the received records one by one, straight from the radio receive ring
+static void sniffer_send_records(void)
+{
+    const struct esbSnifferRecord_s *record;
+
+    for (int i = 0; i < ESB_SNIFFER_RING_SIZE && (record = esb_sniffer_peek()) != NULL; i++) {
+        if (!usb_in_write(stream_endpoint(), record, record->length, K_NO_WAIT)) {
+            // No IN buffer free, the record is kept in the ring and sent on the next round
+            break;
+        }
+        esb_sniffer_release();
+        led_pulse_green(K_MSEC(50));
+    }
+}
+
+// Pack the received records back to back and send them when the buffer is full or when
+// the oldest one has waited for the latency budget
+static void sniffer_send_aggregated(void)
+{
+    const struct esbSnifferRecord_s *record;
+    bool full = false;
+
+    for (int i = 0; i < ESB_SNIFFER_RING_SIZE && (record = esb_sniffer_peek()) != NULL; i++) {
+        if (sniffer_aggregate.length + record->length > SNIFFER_AGGREGATE_BUFFER_SIZE) {
+            full = true;
+            break;
+        }
+        if (sniffer_aggregate.length == 0) {
+            // Records can wait in the radio ring before being copied, the latency starts at reception
+            sniffer_aggregate.first_record_us = record->timestamp_us;
+        }
+        memcpy(&sniffer_aggregate.buffer[sniffer_aggregate.length], record, record->length);
+        sniffer_aggregate.length += record->length;
+        esb_sniffer_release();
+    }
+
+    if (sniffer_aggregate.length == 0) {
+        return;
+    }
+
+    uint32_t waited_us = (uint32_t)esb_get_time_us() - sniffer_aggregate.first_record_us;
+    if (full || waited_us >= state.sniffer_latency_ms * 1000U) {
+        // Without IN buffer free, the records keep waiting and are sent on the next round
+        if (usb_in_write(stream_endpoint(), sniffer_aggregate.buffer, sniffer_aggregate.length, K_NO_WAIT)) {
+            sniffer_aggregate.length = 0;
+            led_pulse_green(K_MSEC(50));
+        }
+    }
+}
+
 static void usb_thread(void *, void *, void *) {
-    static struct usb_command command;
-    static struct esbPacket_s packet;
-    static struct esbPacket_s ack;
-    uint8_t rssi;
-    uint8_t arc_counter;
+    struct usb_command *command;
 
     while(1) {
-        if (state.sniffer_mode) {
-            // In sniffer mode: poll command queue for setup commands (non-blocking)
+        if (state.radio_mode != RADIO_MODE_PTX) {
+            // In sniffer and PRX mode: poll command queue for setup commands (non-blocking)
             if (k_msgq_get(&command_queue, &command, K_NO_WAIT) == 0) {
-                if (command.type == command_setup) {
+                if (command->type == command_setup) {
                     k_mutex_lock(&usb_radio_mutex, K_FOREVER);
-                    handle_vendor_command(&command.setup);
+                    handle_vendor_command(&command->setup);
                     k_mutex_unlock(&usb_radio_mutex);
                 }
-                else if (command.type == command_data) {
-                    if (command.data.length < 6) {
-                        // Need at least 5 address bytes + 1 byte payload
-                        continue;
+                else if (command->type == command_data && state.radio_mode == RADIO_MODE_SWARM) {
+                    // Uplink payload: target index(1) + payload(1-32)
+                    if (command->data.length < 2 ||
+                        !swarm_set_payload(command->data.payload[0], &command->data.payload[1], command->data.length - 1)) {
+                        LOG_WRN("Invalid swarm payload, dropping");
+                    }
+                }
+                else if (command->type == command_data && state.radio_mode == RADIO_MODE_POLL) {
+                    // Uplink packet: payload(1-32)
+                    if (!poll_send(command->data.payload, command->data.length)) {
+                        LOG_WRN("Uplink queue full or invalid packet, dropping");
+                    }
+                }
+                else if (command->type == command_data && state.radio_mode == RADIO_MODE_PRX) {
+                    // Ack payload: pipe(1) + payload(0-32)
+                    uint8_t pipe = command->data.payload[0];
+                    if (command->data.length < 1 ||
+                        !esb_prx_write_ack_payload(pipe, &command->data.payload[1], command->data.length - 1)) {
+                        LOG_WRN("Ack payload queue full or invalid for pipe %d, dropping", pipe);
                     }
+                }
+                else if (command->type == command_data && state.radio_mode == RADIO_MODE_SPECTRUM) {
+                    // Spectrum mode never transmits
+                    LOG_WRN("Data ignored in spectrum mode, dropping");
+                }
+                else if (command->type == command_data && command->data.length >= 6) {
+                    // Need at least 5 address bytes + 1 byte payload
                     uint8_t address[5];
-                    memcpy(address, command.data.payload, 5);
-                    uint8_t payload_length = command.data.length - 5;
+                    memcpy(address, command->data.payload, 5);
+                    uint8_t payload_length = command->data.length - 5;
                     if (payload_length > ESB_MAX_PAYLOAD_LENGTH) {
                         payload_length = ESB_MAX_PAYLOAD_LENGTH;
                     }
-                    packet.length = payload_length;
-                    memcpy(packet.data, &command.data.payload[5], payload_length);
+                    // Move the payload over the address to send the packet from the command buffer
+                    memmove(command->data.packet.data, &command->data.payload[5], payload_length);
+                    command->data.packet.length = payload_length;
 
                     k_mutex_lock(&usb_radio_mutex, K_FOREVER);
-                    esb_sniffer_send(&packet, address);
+                    esb_sniffer_send(&command->data.packet, address);
                     k_mutex_unlock(&usb_radio_mutex);
 
                     led_pulse_green(K_MSEC(50));
                 }
+                command_release(command);
             }
 
-            // Poll sniffer queue for received packets
-            static struct esbSnifferPacket_s sniffer_pkt;
-            if (k_msgq_get(&sniffer_queue, &sniffer_pkt, K_MSEC(1)) == 0) {
-                // Format: total_length(1) + rssi(1) + pipe(1) + timestamp(4) + payload(0-32)
-                uint8_t total_length = 7 + sniffer_pkt.length;
-                state.usb_answer[0] = total_length;
-                state.usb_answer[1] = sniffer_pkt.rssi;
-                state.usb_answer[2] = sniffer_pkt.pipe;
-                memcpy(&state.usb_answer[3], &sniffer_pkt.timestamp_us, 4);
-                if (sniffer_pkt.length > 0) {
-                    memcpy(&state.usb_answer[7], sniffer_pkt.data, sniffer_pkt.length);
-                }
+            if (state.radio_mode == RADIO_MODE_SPECTRUM) {
+                spectrum_step();
+                // The short measurements busy-wait, let the other threads run between two rounds
+                k_yield();
+                continue;
+            }
 
-                usb_write(CRAZYRADIO_IN_EP_ADDR, state.usb_answer, total_length, NULL);
-                if (total_length == CRAZYRADIO_BULK_EP_MPS) {
-                    usb_write(CRAZYRADIO_IN_EP_ADDR, state.usb_answer, 0, NULL);
-                }
-                led_pulse_green(K_MSEC(50));
+            // Send the received records (sniffed, or received in PRX mode), they are already
+            // in the USB format: total_length(1) + rssi(1) + pipe(1) + timestamp(4) + [channel(1) + flags(1)]
+            // + payload(0-63)
+            k_sem_take(&sniffer_rx_sem, K_MSEC(1));
+            if (state.radio_mode == RADIO_MODE_DISCOVERY) {
+                // Raw frames are only used to rank the candidate addresses
+                discovery_process();
+            } else if (state.sniffer_format & SNIFFER_FORMAT_AGGREGATED) {
+                sniffer_send_aggregated();
+            } else {
+                sniffer_send_records();
             }
             continue;
         }
 
-        k_msgq_get(&command_queue, &command, K_FOREVER);
+        if (!scan_job.running) {
+            k_msgq_get(&command_queue, &command, K_FOREVER);
+        } else if (k_msgq_get(&command_queue, &command, K_NO_WAIT) != 0) {
+            // Scan one channel when there is no command to handle, the PTX traffic goes on
+            // between two channels
+            k_mutex_lock(&usb_radio_mutex, K_FOREVER);
+            scan_step();
+            k_mutex_unlock(&usb_radio_mutex);
+            continue;
+        }
 
         k_mutex_lock(&usb_radio_mutex, K_FOREVER);
-        if (command.type == command_data) {
-            
+        if (command->type == command_data) {
+            struct tx_context *ctx;
+            k_mem_slab_alloc(&tx_context_slab, (void **)&ctx, K_FOREVER);
+            ctx->command = command;
+            ctx->packet = &command->data.packet;
+            struct esbPacket_s *packet = ctx->packet;
+
             if (state.inline_mode) {
                 // Get the header
-                inline_mode_out_header *header = (inline_mode_out_header *)command.data.payload;
+                inline_mode_out_header *header = (inline_mode_out_header *)command->data.payload;
                 state.channel = header->channel;
-                esb_set_channel(state.channel);
                 state.datarate = header->datarate;
-                esb_set_bitrate(state.datarate);
                 state.ack_enabled = header->ack_enabled;
-                esb_set_ack_enabled(state.ack_enabled);
-                esb_set_address(header->address);
+                memcpy(state.address, header->address, 5);
+                state.tx_pipe = 0;
+                if (state.datarate != 0 && state.channel <= 100) {
+                    // Only the settings that changed since the previous packet are applied
+                    struct esbRadioConfig_s config;
+                    memcpy(config.address, header->address, 5);
+                    config.channel = state.channel;
+                    config.bitrate = (state.datarate == 1) ? radioBitrate1M : radioBitrate2M;
+                    config.ack_enabled = state.ack_enabled;
+                    esb_set_radio_config(&config);
+                }
                 // Prepare the packet data
                 int payload_length = header->length - sizeof(inline_mode_out_header);
                 if (payload_length > 32+8) {
                     payload_length = 32+8;
                 }
-                memcpy(packet.data, &command.data.payload[sizeof(inline_mode_out_header)], payload_length);
-                packet.length = payload_length;
 
-                LOG_ERR("Inline mode packet: chan %d, dr %d, ack %d, addr %02x%02x%02x%02x%02x, len %d", state.channel, state.datarate, state.ack_enabled, header->address[0], header->address[1], header->address[2], header->address[3], header->address[4], payload_length);
-            } else if (!state.ack_enabled && command.data.length > 32) {
+                LOG_DBG("Inline mode packet: chan %d, dr %d, ack %d, addr %02x%02x%02x%02x%02x, len %d", state.channel, state.datarate, state.ack_enabled, header->address[0], header->address[1], header->address[2], header->address[3], header->address[4], payload_length);
+
+                // Move the payload over the header, the header must not be used after this
+                memmove(packet->data, &command->data.payload[sizeof(inline_mode_out_header)], payload_length);
+                packet->length = payload_length;
+            } else if (!state.ack_enabled && command->data.length > 32) {
                 // If we are not receiving ack (ie. broadcast) and the received data is > 32 bytes,
                 // this means that the buffer actually contains 2 packets to send
-                // Send the first one right away
-                memcpy(packet.data, command.data.payload, command.data.length/2);
-                packet.length = command.data.length/2;
-                esb_send_packet(&packet, &ack, &rssi, &arc_counter);
-
-                // And prepare the second one to be send by the normal execution flow
-                memcpy(packet.data, &command.data.payload[command.data.length/2], command.data.length/2);
-                packet.length = command.data.length/2;
+                // Both are sent from the command buffer. The second one is moved further
+                // to make room for its header, and is sent by the normal execution flow.
+                int length = MIN(command->data.length, sizeof(command->data.payload) - sizeof(command->data.packet_header)) / 2;
+                ctx->packet = (struct esbPacket_s *)&command->data.payload[length];
+                memmove(ctx->packet->data, &command->data.payload[length], length);
+                ctx->packet->length = length;
+
+                // Send the first one right away. It is done before the second one, which
+                // releases the buffer.
+                struct tx_context *first;
+                k_mem_slab_alloc(&tx_context_slab, (void **)&first, K_FOREVER);
+                first->command = NULL;
+                first->packet = packet;
+                packet->length = length;
+                first->answer = false;
+                first->invalid_settings = false;
+                queue_packet(first);
             } else {
                 // Otherwise, cap to 32 bytes and prepare the unicast packets
-                if (command.data.length > 32) {
-                    command.data.length = 32;
+                if (command->data.length > 32) {
+                    command->data.length = 32;
                 }
-                memcpy(packet.data, command.data.payload, command.data.length);
-                packet.length = command.data.length;
+                packet->length = command->data.length;
             }
-            
-            if (state.datarate != 0 && state.channel <= 100) {
-                
-                // Send the packet
-                bool acked = esb_send_packet(&packet, &ack, &rssi, &arc_counter);
 
-                if (acked || !state.ack_enabled) {
-                    led_pulse_green(K_MSEC(50));
-                } else {
-                    led_pulse_red(K_MSEC(50));
-                }
+            ctx->answer = true;
+            ctx->inline_mode = state.inline_mode;
+            ctx->inline_rssi_mode = state.inline_rssi_mode;
+            ctx->ack_enabled = state.ack_enabled;
+            ctx->invalid_settings = (state.datarate == 0 || state.channel > 100);
+
+            // The answer is sent by usb_answer_thread once the radio is done with the packet,
+            // meanwhile the next command can be received and prepared
+            queue_packet(ctx);
+        } else if (command->type == command_setup) {
+            LOG_DBG("Handling setup command %d", command->setup.setup_packet.bRequest);
+            handle_vendor_command(&command->setup);
+            command_release(command);
+        }
+        k_mutex_unlock(&usb_radio_mutex);
+    }
+}
 
-                if (ack.length > 32) {
-                    LOG_ERR("Got an ack of size %d!", ack.length);
-                    ack.length = 32;
-                }
+// Send a stream event, only when the stream has its own endpoint: on EP1 IN it would be
+// mixed with the PTX answers
+static void send_stream_event(uint8_t type, const void *data, int length)
+{
+    uint8_t event[2 + sizeof(struct fleet_record)];
 
-                if (state.inline_mode && !state.inline_rssi_mode) {
-                    // Prepare the inline mode header
-                    inline_mode_in_header *usb_header = (inline_mode_in_header *)state.usb_answer;
-                    memset(usb_header, 0, sizeof(inline_mode_in_header));
-                    usb_header->length = ack.length + sizeof(inline_mode_in_header);
-                    usb_header->ack_received = acked ? 1 : 0;
-                    if (state.ack_enabled) usb_header->rssi_lt_64dbm = (rssi < 64) ? 1 : 0;
-                    usb_header->invalid_settings = (state.datarate == 0 || state.channel > 100) ? 1 : 0;
-                    if (state.ack_enabled) usb_header->arc_counter = arc_counter & 0x0f;
-
-                    // Shift the ack data
-                    if (acked && ack.length > 0) {
-                        memcpy(&state.usb_answer[sizeof(inline_mode_in_header)], ack.data, ack.length);
-                    }
+    if (!state.separate_stream) {
+        return;
+    }
 
-                    if (usb_write(CRAZYRADIO_IN_EP_ADDR, state.usb_answer, usb_header->length, NULL)) {
-                        LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                    }
-                } else if (state.inline_mode && state.inline_rssi_mode) {
-                    // Prepare the inline with rssi mode header
-                    inline_rssi_mode_in_header *usb_header = (inline_rssi_mode_in_header *)state.usb_answer;
-                    memset(usb_header, 0, sizeof(inline_rssi_mode_in_header));
-                    usb_header->length = ack.length + sizeof(inline_rssi_mode_in_header);
-                    usb_header->ack_received = acked ? 1 : 0;
-                    if (state.ack_enabled) usb_header->rssi_lt_64dbm = (rssi < 64) ? 1 : 0;
-                    usb_header->invalid_settings = (state.datarate == 0 || state.channel > 100) ? 1 : 0;
-                    if (state.ack_enabled) usb_header->arc_counter = arc_counter & 0x0f;
-                    usb_header->rssi_dbm = rssi;
-
-                    // Shift the ack data
-                    if (acked && ack.length > 0) {
-                        memcpy(&state.usb_answer[sizeof(inline_rssi_mode_in_header)], ack.data, ack.length);
-                    }
+    event[0] = 2 + length;
+    event[1] = type;
+    memcpy(&event[2], data, length);
+    // Dropped if the host does not read the stream, the results can also be read with requests
+    usb_in_write(&usb_stream, event, event[0], K_NO_WAIT);
+}
 
-                    if (usb_write(CRAZYRADIO_IN_EP_ADDR, state.usb_answer, usb_header->length, NULL)) {
-                        LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                    }
-                } else {
-                    if (!state.ack_enabled) {
-                        led_pulse_green(K_MSEC(50));
-                    } else if (acked && ack.length <= 32) {
-                        static char usb_answer[33];
-                        usb_answer[0] = (arc_counter & 0x0f) << 4 | (rssi < 64)<<1 | 1;
-                        memcpy(&usb_answer[1], ack.data, ack.length);
-                    
-                        if (usb_write(CRAZYRADIO_IN_EP_ADDR, usb_answer, ack.length + 1, NULL)) {
-                            LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                        }
-                    } else {
-                        char no_ack_answer[1] = {0};
-                
-                        if (usb_write(CRAZYRADIO_IN_EP_ADDR, no_ack_answer, 1, NULL)) {
-                            LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                        }
-                    }
-                }
-                
+static void scan_stop(void)
+{
+    scan_job.running = false;
+    k_sem_give(&scan_done_sem);
+}
 
-            } else {
-                LOG_DBG("Not sending, radio settings not handled!");
-                if (state.inline_mode && !state.inline_rssi_mode) {
-                    // Prepare the inline mode header
-                    inline_mode_in_header invalid_settings_header = {
-                        .length = sizeof(inline_mode_in_header),
-                        .ack_received = 0,
-                        .rssi_lt_64dbm = 0,
-                        .invalid_settings = 1,
-                        .arc_counter = 0,
-                    };
-
-                    if (usb_write(CRAZYRADIO_IN_EP_ADDR, (void*) &invalid_settings_header, invalid_settings_header.length, NULL)) {
-                        LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                    }
-                } else if (state.inline_mode && state.inline_rssi_mode) {
-                    // Prepare the inline with rssi mode header
-                    inline_rssi_mode_in_header invalid_settings_header = {
-                        .length = sizeof(inline_rssi_mode_in_header),
-                        .ack_received = 0,
-                        .rssi_lt_64dbm = 0,
-                        .invalid_settings = 1,
-                        .arc_counter = 0,
-                        .rssi_dbm = 0,
-                    };
-
-                    if (usb_write(CRAZYRADIO_IN_EP_ADDR, (void*) &invalid_settings_header, invalid_settings_header.length, NULL)) {
-                        LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                    }
-                } else {
-                    char no_ack_answer[1] = {0};
-            
-                    if (usb_write(CRAZYRADIO_IN_EP_ADDR, no_ack_answer, 1, NULL)) {
-                        LOG_DBG("ep 0x%x", CRAZYRADIO_IN_EP_ADDR);
-                    }
-                }
+// Probe the current target on each channel from start to stop
+static void scan_start_channels(uint8_t start, uint8_t stop, const uint8_t *data, int length)
+{
+    LOG_DBG("Starting scan from channel %d to %d", start, stop);
+    memcpy(scan_job.packet.data, data, length);
+    scan_job.packet.length = length;
+    memcpy(scan_job.address, state.address, 5);
+    scan_job.suffix = state.address[4];
+    scan_job.last_suffix = state.address[4];
+    scan_job.datarates = (state.datarate == 1) ? FLEET_SCAN_1M : FLEET_SCAN_2M;
+    scan_job.datarate = scan_job.datarates;
+    scan_job.start_channel = start;
+    scan_job.stop_channel = stop;
+    scan_job.channel = start;
+    scan_job.found_count = 0;
+    scan_job.fleet = false;
+    scan_job.running = true;
+}
 
-                led_pulse_red(K_MSEC(50));
-            }
-        } else if (command.type == command_setup) {
-            LOG_DBG("Handling setup command %d", command.setup.setup_packet.bRequest);
-            handle_vendor_command(&command.setup);
+// Move to the next probe, skipping the rest of the current target if it has been found
+static void scan_advance(bool target_found)
+{
+    if (!target_found && scan_job.channel < scan_job.stop_channel) {
+        scan_job.channel++;
+        return;
+    }
+    scan_job.channel = scan_job.start_channel;
+
+    if (!target_found && scan_job.datarate == FLEET_SCAN_1M && (scan_job.datarates & FLEET_SCAN_2M)) {
+        scan_job.datarate = FLEET_SCAN_2M;
+        return;
+    }
+    scan_job.datarate = (scan_job.datarates & FLEET_SCAN_1M) ? FLEET_SCAN_1M : FLEET_SCAN_2M;
+
+    // In a fleet scan, the targets already found are not probed again
+    while (scan_job.suffix < scan_job.last_suffix) {
+        scan_job.suffix++;
+        if (!scan_job.fleet || !(scan_job.found_targets[scan_job.suffix / 32] & BIT(scan_job.suffix % 32))) {
+            return;
         }
-        k_mutex_unlock(&usb_radio_mutex);
     }
+
+    scan_stop();
+    uint8_t found_count = scan_job.fleet ? scan_job.record_count : scan_job.found_count;
+    send_stream_event(STREAM_EVENT_SCAN_DONE, &found_count, 1);
 }
 
-static void fw_scan(uint8_t start, uint8_t stop, char* data, int data_length) {
-    state.scan_result_length = 0;
+static void scan_step(void)
+{
+    struct esbRadioConfig_s config;
+    struct esbPacket_s ack;
+    uint8_t rssi;
+    uint8_t retry;
 
-    if (stop < start) {
+    memcpy(config.address, scan_job.address, 5);
+    config.address[4] = scan_job.suffix;
+    config.channel = scan_job.channel;
+    config.bitrate = (scan_job.datarate == FLEET_SCAN_1M) ? radioBitrate1M : radioBitrate2M;
+    config.ack_enabled = true;
+    esb_set_radio_config(&config);
+
+    bool acked = esb_send_packet(&scan_job.packet, &ack, &rssi, &retry);
+
+    // Back to the target of the PTX traffic
+    memcpy(config.address, state.address, 5);
+    config.channel = state.channel;
+    config.bitrate = (state.datarate == 1) ? radioBitrate1M : radioBitrate2M;
+    config.ack_enabled = state.ack_enabled;
+    esb_set_radio_config(&config);
+    if (state.tx_pipe != 0) {
+        esb_set_tx_pipe(state.tx_pipe);
+    }
+
+    if (!acked) {
+        led_pulse_red(K_MSEC(50));
+        scan_advance(false);
         return;
     }
 
-    static struct esbPacket_s packet;
-    static struct esbPacket_s ack;
-    uint8_t rssi;
-    uint8_t retry;
+    led_pulse_green(K_MSEC(50));
+    if (scan_job.fleet) {
+        scan_job.found_targets[scan_job.suffix / 32] |= BIT(scan_job.suffix % 32);
+        struct fleet_record record = {
+            .channel = scan_job.channel,
+            .datarate = (scan_job.datarate == FLEET_SCAN_1M) ? 1 : 2,
+            .rssi = rssi,
+            .retry = retry,
+            .ack_length = ack.length,
+        };
+        memcpy(record.address, scan_job.address, 4);
+        record.address[4] = scan_job.suffix;
+        if (scan_job.record_count < FLEET_SCAN_MAX_RECORDS) {
+            scan_job.records[scan_job.record_count++] = record;
+        }
+        send_stream_event(STREAM_EVENT_FLEET_FOUND, &record, sizeof(record));
+        scan_advance(true);
+    } else {
+        scan_job.found[scan_job.found_count++] = scan_job.channel;
+        // channel(1) + rssi(1) + retry(1) + ack_length(1)
+        uint8_t found[4] = {scan_job.channel, rssi, retry, ack.length};
+        send_stream_event(STREAM_EVENT_SCAN_FOUND, found, sizeof(found));
+        scan_advance(false);
+    }
+}
 
-    if (data_length > 32) {
-        data_length = 32;
+// Measure the next channel, or part of it, and send the sweep once all the channels have been
+// measured
+static void spectrum_step(void)
+{
+    struct esbRssiStats_s *result = &spectrum.sweep.channels[spectrum.channel];
+    struct esbRssiStats_s stats;
+
+    if (spectrum.channel == 0 && spectrum.sample == 0) {
+        spectrum.sweep.timestamp_us = sys_cpu_to_le32((uint32_t)esb_get_time_us());
     }
 
-    memcpy(packet.data, data, data_length);
-    packet.length = data_length;
+    int samples = MIN(spectrum.samples - spectrum.sample,
+                      MAX(1, SPECTRUM_MAX_STEP_US / MAX(spectrum.interval_us, 1)));
 
-    for (int channel = start; channel <= stop; channel++) {
-        esb_set_channel(channel);
-        if (esb_send_packet(&packet, &ack, &rssi, &retry)) {
-            led_pulse_green(K_MSEC(50));
-            state.scan_result[state.scan_result_length++] = channel;
-            if (state.scan_result_length >= ESB_MAX_PAYLOAD_LENGTH) {
-                return;
-            }
-        } else {
-            led_pulse_red(K_MSEC(50));
+    k_mutex_lock(&usb_radio_mutex, K_FOREVER);
+    bool measured = esb_measure_rssi(spectrum.channel, samples, spectrum.interval_us, &stats);
+    k_mutex_unlock(&usb_radio_mutex);
+
+    if (!measured) {
+        // Reported as ESB_RSSI_INVALID, the sweep goes on with the next channel
+        *result = stats;
+    } else {
+        if (spectrum.sample == 0) {
+            spectrum.min = 0xff;
+            spectrum.max = 0;
+            spectrum.sum = 0;
+        }
+        spectrum.min = MIN(spectrum.min, stats.min);
+        spectrum.max = MAX(spectrum.max, stats.max);
+        spectrum.sum += stats.mean * samples;
+        spectrum.sample += samples;
+
+        if (spectrum.sample < spectrum.samples) {
+            return;
         }
+
+        result->min = spectrum.min;
+        result->mean = spectrum.sum / spectrum.samples;
+        result->max = spectrum.max;
+    }
+
+    spectrum.sample = 0;
+    spectrum.channel++;
+    if (spectrum.channel < SPECTRUM_CHANNEL_COUNT) {
+        return;
     }
+
+    spectrum.sweep.index = sys_cpu_to_le32(spectrum.sweep_count);
+    spectrum.sweep.channel_count = SPECTRUM_CHANNEL_COUNT;
+    // Without IN buffer free, the sweep is dropped: the host gets the next one
+    if (usb_in_write(stream_endpoint(), &spectrum.sweep, sizeof(spectrum.sweep), K_NO_WAIT)) {
+        led_pulse_green(K_MSEC(50));
+    }
+    spectrum.sweep_count++;
+    spectrum.channel = 0;
+}
+
+// Apply the PTX radio settings from the state, used when leaving a mode that changes them
+static void restore_radio_settings(void) {
+    if (state.channel <= 100) {
+        esb_set_channel(state.channel);
+    }
+    if (state.datarate == 1) {
+        esb_set_bitrate(radioBitrate1M);
+    } else if (state.datarate == 2) {
+        esb_set_bitrate(radioBitrate2M);
+    }
+    esb_set_address(state.address);
+    esb_set_tx_pipe(state.tx_pipe);
+    esb_set_ack_enabled(state.ack_enabled);
+    esb_set_arc(state.arc);
 }
 
 static void handle_vendor_command(struct setup_command* setup) {
@@ -631,6 +1305,8 @@ static void handle_vendor_command(struct setup_command* setup) {
     } else if (setup->setup_packet.bRequest == SET_RADIO_ADDRESS && setup->setup_packet.wLength == 5) {
         LOG_DBG("Setting radio address %02x%02x%02x%02x%02x", (unsigned int)(setup->data)[0], (unsigned int)(setup->data)[1], (unsigned int)(setup->data)[2], (unsigned int)(setup->data)[3], (unsigned int)(setup->data)[4]);
         esb_set_address(setup->data);
+        memcpy(state.address, setup->data, 5);
+        state.tx_pipe = 0;
         // Reset inline mode
         state.inline_mode = false;
     } else if (setup->setup_packet.bRequest == SET_DATA_RATE && setup->setup_packet.wLength == 0 && setup->setup_packet.wValue < 3) {
@@ -653,9 +1329,11 @@ static void handle_vendor_command(struct setup_command* setup) {
         fem_set_power(fem_power);
     } else if (setup->setup_packet.bRequest == SET_RADIO_ARD && setup->setup_packet.wLength == 0) {
         LOG_DBG("Setting radio ARD %d", setup->setup_packet.wValue);
+        esb_set_ard(setup->setup_packet.wValue);
     } else if (setup->setup_packet.bRequest == SET_RADIO_ARC && setup->setup_packet.wLength == 0) {
         LOG_DBG("Setting radio ARC %d", setup->setup_packet.wValue & 0x0f);
-        esb_set_arc(setup->setup_packet.wValue & 0x0f);
+        state.arc = setup->setup_packet.wValue & 0x0f;
+        esb_set_arc(state.arc);
     } else if (setup->setup_packet.bRequest == ACK_ENABLE && setup->setup_packet.wLength == 0) {
         bool enabled = setup->setup_packet.wValue != 0;
         LOG_DBG("Setting radio ACK Enable %s", enabled?"true":"false");
@@ -672,28 +1350,208 @@ static void handle_vendor_command(struct setup_command* setup) {
         LOG_DBG("Setting radio Mode %d", setup->setup_packet.wValue);
     } else if (setup->setup_packet.bRequest == SET_RADIO_MODE && setup->setup_packet.wLength == 0) {
         LOG_DBG("Setting radio mode %d", setup->setup_packet.wValue);
-        if (setup->setup_packet.wValue == 1) {
+        uint8_t mode = setup->setup_packet.wValue;
+
+        if (mode != state.radio_mode) {
+            // The scan job only runs in PTX mode
+            scan_stop();
+            // Exit the current mode, back to normal PTX mode
+            esb_sniffer_stop();
+            esb_prx_stop();
+            if (state.radio_mode == RADIO_MODE_SWARM) {
+                swarm_stop();
+                restore_radio_settings();
+            }
+            if (state.radio_mode == RADIO_MODE_POLL) {
+                poll_stop();
+                esb_set_ack_enabled(state.ack_enabled);
+            }
+            state.radio_mode = RADIO_MODE_PTX;
+            sniffer_aggregate.length = 0;
+            led_set_blue(false);
+        }
+
+        if (mode == RADIO_MODE_SNIFFER && state.radio_mode != RADIO_MODE_SNIFFER) {
             // Enter sniffer mode
-            state.sniffer_mode = true;
+            state.radio_mode = RADIO_MODE_SNIFFER;
             state.inline_mode = false;
             state.inline_rssi_mode = false;
-            k_msgq_purge(&sniffer_queue);
-            atomic_set(&sniffer_drop_count, 0);
             esb_sniffer_start(sniffer_rx_callback);
             led_set_blue(true);
-        } else if (setup->setup_packet.wValue == 0) {
-            // Exit sniffer mode, back to normal PTX mode
-            esb_sniffer_stop();
-            state.sniffer_mode = false;
-            led_set_blue(false);
+        } else if (mode == RADIO_MODE_PRX && state.radio_mode != RADIO_MODE_PRX) {
+            // Enter PRX mode, received packets are reported like sniffed packets
+            state.radio_mode = RADIO_MODE_PRX;
+            state.inline_mode = false;
+            state.inline_rssi_mode = false;
+            esb_prx_flush_ack_payloads();
+            esb_prx_start(sniffer_rx_callback);
+            led_set_blue(true);
+        } else if (mode == RADIO_MODE_SWARM && state.radio_mode != RADIO_MODE_SWARM) {
+            // Enter swarm mode, the swarm engine polls the targets and sends aggregated results
+            state.radio_mode = RADIO_MODE_SWARM;
+            state.inline_mode = false;
+            state.inline_rssi_mode = false;
+            swarm_start(swarm_result_callback);
+            led_set_blue(true);
+        } else if (mode == RADIO_MODE_POLL && state.radio_mode != RADIO_MODE_POLL) {
+            // Enter poll mode, the target set with the current radio settings is polled by the firmware
+            state.radio_mode = RADIO_MODE_POLL;
+            state.inline_mode = false;
+            state.inline_rssi_mode = false;
+            poll_start(poll_downlink_callback);
+            led_set_blue(true);
+        } else if (mode == RADIO_MODE_DISCOVERY && state.radio_mode != RADIO_MODE_DISCOVERY) {
+            // Enter discovery mode, active addresses are ranked by number of valid packets
+            state.radio_mode = RADIO_MODE_DISCOVERY;
+            state.inline_mode = false;
+            state.inline_rssi_mode = false;
+            discovery_reset();
+            esb_discovery_start(sniffer_rx_callback);
+            led_set_blue(true);
+        } else if (mode == RADIO_MODE_SPECTRUM && state.radio_mode != RADIO_MODE_SPECTRUM) {
+            // Enter spectrum mode, the radio stays in PTX mode and only receives to measure
+            state.radio_mode = RADIO_MODE_SPECTRUM;
+            state.inline_mode = false;
+            state.inline_rssi_mode = false;
+            spectrum.channel = 0;
+            spectrum.sample = 0;
+            spectrum.sweep_count = 0;
+            led_set_blue(true);
         }
     } else if (setup->setup_packet.bRequest == SET_SNIFFER_ADDRESS && setup->setup_packet.wLength == 5) {
         LOG_DBG("Setting sniffer address pipe %d", setup->setup_packet.wValue);
+        if (setup->setup_packet.wValue < ESB_NUM_PIPES) {
+            esb_set_address_pipe(setup->setup_packet.wValue, setup->data);
+        }
         if (setup->setup_packet.wValue == 0) {
-            esb_set_address(setup->data);
-        } else if (setup->setup_packet.wValue == 1) {
-            esb_set_address_pipe1(setup->data);
+            memcpy(state.address, setup->data, 5);
+        }
+    } else if (setup->setup_packet.bRequest == SET_SWARM_TARGET && setup->setup_packet.wLength == 8) {
+        // address(5) + channel(1) + datarate(1) + arc(1)
+        uint8_t *data = (uint8_t *)setup->data;
+        LOG_DBG("Setting swarm target %d", setup->setup_packet.wValue);
+        if (data[6] == 1 || data[6] == 2) {
+            esbBitrate_t bitrate = (data[6] == 1) ? radioBitrate1M : radioBitrate2M;
+            swarm_set_target(setup->setup_packet.wValue, data, data[5], bitrate, data[7]);
+        }
+    } else if (setup->setup_packet.bRequest == SET_SWARM_TARGET && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Removing swarm target %d", setup->setup_packet.wValue);
+        swarm_remove_target(setup->setup_packet.wValue);
+    } else if (setup->setup_packet.bRequest == CLEAR_SWARM_TARGETS && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Clearing swarm targets");
+        swarm_clear_targets();
+    } else if (setup->setup_packet.bRequest == SET_SWARM_PERIOD && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting swarm period %d ms", setup->setup_packet.wValue);
+        swarm_set_period(setup->setup_packet.wValue);
+    } else if (setup->setup_packet.bRequest == SET_POLL_INTERVAL && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting poll max interval %d ms", setup->setup_packet.wValue);
+        poll_set_max_interval(setup->setup_packet.wValue);
+    } else if (setup->setup_packet.bRequest == SET_RADIO_TX_PIPE && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting radio TX pipe %d", setup->setup_packet.wValue);
+        state.tx_pipe = setup->setup_packet.wValue;
+        esb_set_tx_pipe(state.tx_pipe);
+        // Reset inline mode
+        state.inline_mode = false;
+    } else if (setup->setup_packet.bRequest == START_SCAN) {
+        // An empty packet stops the running scan, the results found so far are kept
+        if (setup->length == 0) {
+            LOG_DBG("Stopping scan");
+            scan_stop();
+        } else if (state.radio_mode == RADIO_MODE_PTX) {
+            scan_start_channels(setup->setup_packet.wValue, setup->setup_packet.wIndex, setup->data, setup->length);
+        }
+    } else if (setup->setup_packet.bRequest == CHANNEL_SCANN) {
+        // Same scan as START_SCAN, GET_SCAN_CHANNELS returns once it is done. The channels above
+        // 100 are not used by ESB.
+        uint8_t start = setup->setup_packet.wValue;
+        uint8_t stop = MIN(setup->setup_packet.wIndex, 100);
+        scan_job.found_count = 0;
+        if (state.radio_mode == RADIO_MODE_PTX && start <= stop) {
+            scan_start_channels(start, stop, setup->data, setup->length);
+        } else {
+            // Nothing to scan, the results are empty
+            scan_stop();
+        }
+    } else if (setup->setup_packet.bRequest == START_FLEET_SCAN) {
+        uint8_t flags = setup->data[0];
+        uint8_t datarates = flags & (FLEET_SCAN_1M | FLEET_SCAN_2M);
+
+        if (state.radio_mode == RADIO_MODE_PTX && datarates != 0) {
+            LOG_DBG("Starting fleet scan, channels %d-%d, suffixes %d-%d, datarates 0x%x",
+                    setup->setup_packet.wValue & 0xff, setup->setup_packet.wValue >> 8,
+                    setup->setup_packet.wIndex & 0xff, setup->setup_packet.wIndex >> 8, datarates);
+            // The targets found are only known by their suffix, they are skipped only if the
+            // base address is the same
+            if (!(flags & FLEET_SCAN_CONTINUE) || memcmp(scan_job.address, &setup->data[1], 4) != 0) {
+                memset(scan_job.found_targets, 0, sizeof(scan_job.found_targets));
+            }
+            if (!(flags & FLEET_SCAN_CONTINUE)) {
+                scan_job.record_count = 0;
+            }
+            memcpy(scan_job.address, &setup->data[1], 5);
+            memcpy(scan_job.packet.data, &setup->data[6], setup->length - 6);
+            scan_job.packet.length = setup->length - 6;
+            scan_job.datarates = datarates;
+            scan_job.datarate = (datarates & FLEET_SCAN_1M) ? FLEET_SCAN_1M : FLEET_SCAN_2M;
+            scan_job.start_channel = setup->setup_packet.wValue & 0xff;
+            scan_job.stop_channel = setup->setup_packet.wValue >> 8;
+            scan_job.channel = scan_job.start_channel;
+            scan_job.suffix = setup->setup_packet.wIndex & 0xff;
+            scan_job.last_suffix = setup->setup_packet.wIndex >> 8;
+            scan_job.fleet = true;
+            scan_job.running = true;
+            // The first suffix can also be a target already found
+            if (scan_job.found_targets[scan_job.suffix / 32] & BIT(scan_job.suffix % 32)) {
+                scan_advance(true);
+            }
+        }
+    } else if (setup->setup_packet.bRequest == SET_SPECTRUM_CONFIG && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting spectrum sweep %d samples every %d us", setup->setup_packet.wValue, setup->setup_packet.wIndex);
+        spectrum.samples = setup->setup_packet.wValue;
+        spectrum.interval_us = setup->setup_packet.wIndex;
+        // The current sweep restarts with the new settings
+        spectrum.channel = 0;
+        spectrum.sample = 0;
+    } else if (setup->setup_packet.bRequest == SET_STREAM_ENDPOINT && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting stream endpoint %d", setup->setup_packet.wValue);
+        state.separate_stream = setup->setup_packet.wValue != 0;
+    } else if (setup->setup_packet.bRequest == SET_SNIFFER_FORMAT && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting sniffer format %d, latency %d ms", setup->setup_packet.wValue, setup->setup_packet.wIndex);
+        state.sniffer_format = setup->setup_packet.wValue;
+        state.sniffer_latency_ms = setup->setup_packet.wIndex;
+        sniffer_aggregate.length = 0;
+        esb_sniffer_set_extended_records((state.sniffer_format & SNIFFER_FORMAT_EXTENDED) != 0);
+        esb_sniffer_set_keep_crc_errors((state.sniffer_format & SNIFFER_FORMAT_CRC_ERRORS) != 0);
+    } else if (setup->setup_packet.bRequest == SET_SNIFFER_FILTER && setup->setup_packet.wLength == 12) {
+        // min_length(1) + max_length(1) + pipe_mask(1) + flags(1) + match(4) + mask(4)
+        uint8_t *data = (uint8_t *)setup->data;
+        struct esbSnifferFilter_s filter = {
+            .min_length = data[0],
+            .max_length = data[1],
+            .pipe_mask = data[2],
+            .drop_duplicates = (data[3] & 0x01) != 0,
+        };
+        memcpy(filter.match, &data[4], ESB_SNIFFER_FILTER_MATCH_LENGTH);
+        memcpy(filter.mask, &data[8], ESB_SNIFFER_FILTER_MATCH_LENGTH);
+        LOG_DBG("Setting sniffer filter");
+        esb_sniffer_set_filter(&filter);
+    } else if (setup->setup_packet.bRequest == SET_SNIFFER_FILTER && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Clearing sniffer filter");
+        esb_sniffer_set_filter(NULL);
+    } else if (setup->setup_packet.bRequest == SET_SNIFFER_PIPES && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting sniffer pipes 0x%02x", setup->setup_packet.wValue);
+        esb_set_sniffer_pipes(setup->setup_packet.wValue & 0xff);
+    } else if (setup->setup_packet.bRequest == SET_SNIFFER_HOP_TABLE) {
+        // wValue is the dwell time in 100us units, the data the channels to hop on
+        uint32_t dwell_us = setup->setup_packet.wValue * 100;
+        LOG_DBG("Setting sniffer hop table, %d channels, dwell %d us", setup->setup_packet.wLength, dwell_us);
+        if (!esb_sniffer_set_hop_table((uint8_t *)setup->data, setup->setup_packet.wLength, dwell_us,
+                                       setup->setup_packet.wIndex & 0xff)) {
+            LOG_WRN("Invalid sniffer hop table");
         }
+    } else if (setup->setup_packet.bRequest == SET_RX_PIPES && setup->setup_packet.wLength == 0) {
+        LOG_DBG("Setting RX pipes 0x%02x", setup->setup_packet.wValue);
+        esb_set_rx_pipes(setup->setup_packet.wValue & 0xff);
     } else if (setup->setup_packet.bRequest == SET_INLINE_MODE && setup->setup_packet.wLength == 0) {
         LOG_DBG("Setting radio Inline Mode %d", setup->setup_packet.wValue);
         state.inline_mode = setup->setup_packet.wValue != 0;
@@ -0,0 +1,466 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Native Crazyradio 2.0 USB protocol, see docs/development/native-usb-protocol.md
+//
+// Each bulk OUT transfer carries several tagged radio commands, each with its own target
+// settings. Their responses are tagged with the same sequence number and coalesced in bulk
+// IN transfers, so the host can keep many transactions in flight.
+
+#include <autoconf.h>
+
+#include <zephyr/kernel.h>
+
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/usb/usb_ch9.h>
+#include <zephyr/usb/usb_device.h>
+#include <usb_descriptor.h>
+
+#include "esb.h"
+#include "led.h"
+#include "system.h"
+#include "usb_in.h"
+
+#include <string.h>
+
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(native_usb);
+
+#define NATIVE_NUM_EP 2
+#define NATIVE_OUT_EP_ADDR 0x01
+#define NATIVE_IN_EP_ADDR 0x81
+#define NATIVE_BULK_EP_MPS 64
+
+// Largest OUT transfer, commands do not span transfers
+#define NATIVE_OUT_TRANSFER_MAX_LENGTH 512
+#define NATIVE_OUT_BUFFER_COUNT 4
+#define NATIVE_IN_BUFFER_COUNT 4
+
+// Command types
+#define NATIVE_COMMAND_SEND 0x00
+
+// Send command flags
+#define NATIVE_SEND_ACK_ENABLED 0x01
+#define NATIVE_SEND_NO_RESPONSE 0x02
+
+// Response status flags
+#define NATIVE_STATUS_ACKED 0x01
+#define NATIVE_STATUS_INVALID 0x02
+
+#define NATIVE_MAX_ACK_LENGTH 32
+
+// Vendor requests, same numbers as in the legacy protocol
+#define GET_RADIO_TIME 0x45
+#define RESET_TO_BOOTLOADER 0xff
+
+// Header common to all the commands
+struct native_command_header {
+    uint8_t length;     // Full command length, header included
+    uint8_t type;
+    uint16_t seq;       // Echoed in the response, little endian
+} __attribute__((packed));
+
+// Send a packet to a target and wait for its ack
+struct native_send_command {
+    struct native_command_header header;
+    uint8_t channel;
+    uint8_t datarate;   // 1: 1M, 2: 2M
+    uint8_t flags;      // NATIVE_SEND_* flags
+    uint8_t arc;
+    uint8_t address[5];
+    uint8_t payload[];
+} __attribute__((packed));
+
+struct native_response {
+    uint8_t length;     // Full response length, header included
+    uint8_t status;     // NATIVE_STATUS_* flags
+    uint16_t seq;       // Sequence number of the command, little endian
+    uint8_t rssi;       // Ack RSSI in inverted dBm
+    uint8_t retry;      // Number of retries before the ack
+    uint8_t data[];     // Ack payload
+} __attribute__((packed));
+
+#define NATIVE_RESPONSE_MAX_LENGTH (sizeof(struct native_response) + NATIVE_MAX_ACK_LENGTH)
+
+struct out_transfer {
+    uint32_t length;
+    uint8_t data[NATIVE_OUT_TRANSFER_MAX_LENGTH];
+};
+
+// Radio transaction in flight between native_thread and native_answer_thread
+struct transaction {
+    struct esbTxDesc_s desc;
+    struct esbPacket_s packet;
+    struct esbPacket_s ack;
+    uint16_t seq;
+    bool respond;
+    bool invalid;
+};
+
+K_MEM_SLAB_DEFINE(out_transfer_slab, sizeof(struct out_transfer), NATIVE_OUT_BUFFER_COUNT, 4);
+K_MSGQ_DEFINE(out_transfer_queue, sizeof(struct out_transfer *), NATIVE_OUT_BUFFER_COUNT, 4);
+// Set when the OUT endpoint has been left NAKing the host for lack of buffer
+static atomic_t out_paused;
+
+K_MEM_SLAB_DEFINE(transaction_slab, sizeof(struct transaction), ESB_TX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(transaction_done_queue, sizeof(struct transaction *), ESB_TX_QUEUE_DEPTH, 4);
+
+USB_IN_ENDPOINT_DEFINE(usb_in, NATIVE_IN_EP_ADDR, NATIVE_IN_BUFFER_COUNT);
+
+BUILD_ASSERT(NATIVE_RESPONSE_MAX_LENGTH <= USB_IN_BUFFER_SIZE);
+
+#define INITIALIZER_IF(num_ep, iface_class)				\
+	{								\
+		.bLength = sizeof(struct usb_if_descriptor),		\
+		.bDescriptorType = USB_DESC_INTERFACE,			\
+		.bInterfaceNumber = 0,					\
+		.bAlternateSetting = 0,					\
+		.bNumEndpoints = num_ep,				\
+		.bInterfaceClass = iface_class,				\
+		.bInterfaceSubClass = 0,				\
+		.bInterfaceProtocol = 0,				\
+		.iInterface = 0,					\
+	}
+
+#define INITIALIZER_IF_EP(addr, attr, mps, interval)			\
+	{								\
+		.bLength = sizeof(struct usb_ep_descriptor),		\
+		.bDescriptorType = USB_DESC_ENDPOINT,			\
+		.bEndpointAddress = addr,				\
+		.bmAttributes = attr,					\
+		.wMaxPacketSize = sys_cpu_to_le16(mps),			\
+		.bInterval = interval,					\
+	}
+
+USBD_CLASS_DESCR_DEFINE(primary, 0) struct {
+    struct usb_if_descriptor if0;
+	struct usb_ep_descriptor if0_in_ep;
+	struct usb_ep_descriptor if0_out_ep;
+} __packed native_desc = {
+	.if0 = INITIALIZER_IF(NATIVE_NUM_EP, USB_BCC_VENDOR),
+	.if0_out_ep = INITIALIZER_IF_EP(NATIVE_OUT_EP_ADDR, USB_DC_EP_BULK,
+				       NATIVE_BULK_EP_MPS, 0),
+	.if0_in_ep = INITIALIZER_IF_EP(NATIVE_IN_EP_ADDR, USB_DC_EP_BULK,
+				       NATIVE_BULK_EP_MPS, 0),
+};
+
+// Read the packet waiting on the OUT endpoint. Called from the USB stack, and from
+// out_resume_work once a buffer has been released: the endpoint is NAKing the host then, so
+// no callback can run at the same time.
+static void out_read(uint8_t ep)
+{
+    uint32_t bytes_to_read;
+    // Transfer being received, it spans several USB packets
+    static struct out_transfer *transfer = NULL;
+
+    if (transfer == NULL) {
+        while (k_mem_slab_alloc(&out_transfer_slab, (void **)&transfer, K_NO_WAIT) != 0) {
+            // Out of buffers: the packet is left unread, so the endpoint NAKs the host until
+            // out_transfer_release() resumes reading. The USB stack is never blocked.
+            atomic_set(&out_paused, 1);
+            // Unless a buffer has been released before the flag was set
+            if (k_mem_slab_num_free_get(&out_transfer_slab) == 0 || !atomic_cas(&out_paused, 1, 0)) {
+                transfer = NULL;
+                return;
+            }
+        }
+        transfer->length = 0;
+    }
+
+    usb_dc_ep_read_wait(ep, NULL, 0, &bytes_to_read);
+
+    uint32_t space = sizeof(transfer->data) - transfer->length;
+    if (bytes_to_read <= space) {
+        usb_dc_ep_read_wait(ep, &transfer->data[transfer->length], bytes_to_read, NULL);
+        transfer->length += bytes_to_read;
+    } else {
+        // The commands that do not fit are dropped
+        usb_dc_ep_read_wait(ep, &transfer->data[transfer->length], space, NULL);
+        transfer->length += space;
+        uint8_t scratch[NATIVE_BULK_EP_MPS];
+        usb_dc_ep_read_wait(ep, scratch, bytes_to_read - space, NULL);
+    }
+
+    // The transfer ends with a packet shorter than the max packet size
+    if (bytes_to_read < NATIVE_BULK_EP_MPS) {
+        // Cannot block: the queue can hold all the buffers
+        k_msgq_put(&out_transfer_queue, &transfer, K_NO_WAIT);
+        transfer = NULL;
+    }
+
+    // Accept the next packet only once the state above is up to date
+    usb_dc_ep_read_continue(ep);
+}
+
+static void native_out_cb(uint8_t ep, enum usb_dc_ep_cb_status_code cb_status)
+{
+    out_read(ep);
+}
+
+static void out_resume_handler(struct k_work *work)
+{
+    out_read(NATIVE_OUT_EP_ADDR);
+}
+
+K_WORK_DEFINE(out_resume_work, out_resume_handler);
+
+// Release an OUT buffer, and resume reading the OUT endpoint if it was waiting for one.
+// The endpoint is read from the work queue so that the radio threads never run USB code.
+static void out_transfer_release(struct out_transfer *transfer)
+{
+    k_mem_slab_free(&out_transfer_slab, transfer);
+
+    if (atomic_cas(&out_paused, 1, 0)) {
+        k_work_submit(&out_resume_work);
+    }
+}
+
+static void native_in_cb(uint8_t ep, enum usb_dc_ep_cb_status_code cb_status)
+{
+	// Progresses the transfers started by usb_in_write()
+	usb_transfer_ep_callback(ep, cb_status);
+}
+
+static struct usb_ep_cfg_data ep_cfg[] = {
+	{
+		.ep_cb = native_out_cb,
+		.ep_addr = NATIVE_OUT_EP_ADDR,
+	},
+	{
+		.ep_cb = native_in_cb,
+		.ep_addr = NATIVE_IN_EP_ADDR,
+	},
+};
+
+static int native_vendor_handler(struct usb_setup_packet *setup,
+				   int32_t *len, uint8_t **data)
+{
+	LOG_DBG("Vendor request: bRequest 0x%x bmRequestType 0x%x len %d",
+		setup->bRequest, setup->bmRequestType, *len);
+
+	if (USB_REQTYPE_GET_TYPE(setup->bmRequestType) != USB_REQTYPE_TYPE_VENDOR) {
+		return -ENOTSUP;
+	}
+
+	if (setup->bRequest == GET_RADIO_TIME && usb_reqtype_is_to_host(setup)) {
+		static uint64_t time_le;
+		time_le = sys_cpu_to_le64(esb_get_time_us());
+		*data = (uint8_t *)&time_le;
+		*len = MIN(sizeof(time_le), setup->wLength);
+	} else if (setup->bRequest == RESET_TO_BOOTLOADER) {
+		system_reset_to_uf2();
+	} else {
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static void native_status_cb(struct usb_cfg_data *data, enum usb_dc_status_code cb_status, const uint8_t *param)
+{
+	if (cb_status == USB_DC_RESET || cb_status == USB_DC_DISCONNECTED) {
+		usb_in_cancelled(&usb_in);
+	}
+}
+
+static void native_interface_config(struct usb_desc_header *head, uint8_t bInterfaceNumber)
+{
+	;
+}
+
+USBD_DEFINE_CFG_DATA(native_config) = {
+	.usb_device_description = NULL,
+	.interface_config = native_interface_config,
+	.interface_descriptor = &native_desc.if0,
+	.cb_usb_status = native_status_cb,
+	.interface = {
+		.class_handler = NULL,
+		.custom_handler = NULL,
+		.vendor_handler = native_vendor_handler,
+	},
+	.num_endpoints = ARRAY_SIZE(ep_cfg),
+	.endpoint = ep_cfg,
+};
+
+static void transaction_done(struct esbTxDesc_s *desc)
+{
+    struct transaction *transaction = CONTAINER_OF(desc, struct transaction, desc);
+
+    // Cannot fail: there are never more transactions than the queue can hold
+    k_msgq_put(&transaction_done_queue, &transaction, K_NO_WAIT);
+}
+
+static void queue_transaction(struct transaction *transaction)
+{
+    transaction->desc.packet = &transaction->packet;
+    transaction->desc.ack = &transaction->ack;
+    transaction->ack.length = 0;
+
+    if (transaction->invalid || !esb_submit(&transaction->desc, transaction_done)) {
+        // Not sent, answered once the previously queued transactions have been answered
+        esb_flush();
+        transaction->desc.acked = false;
+        transaction->desc.rssi = 0;
+        transaction->desc.retry = 0;
+        k_msgq_put(&transaction_done_queue, &transaction, K_FOREVER);
+    }
+}
+
+// Queue a transaction for one command, the command has been checked to fit in the transfer
+static void handle_command(const struct native_command_header *header)
+{
+    // ARC currently set in the radio, -1 until the first command sets it
+    static int current_arc = -1;
+    struct transaction *transaction;
+
+    k_mem_slab_alloc(&transaction_slab, (void **)&transaction, K_FOREVER);
+    transaction->seq = sys_le16_to_cpu(header->seq);
+    transaction->respond = true;
+    transaction->invalid = true;
+
+    if (header->type == NATIVE_COMMAND_SEND && header->length >= sizeof(struct native_send_command)) {
+        const struct native_send_command *command = (const struct native_send_command *)header;
+        int payload_length = header->length - sizeof(struct native_send_command);
+
+        transaction->respond = (command->flags & NATIVE_SEND_NO_RESPONSE) == 0;
+
+        if (payload_length <= 32 && command->channel <= 100 &&
+            (command->datarate == 1 || command->datarate == 2)) {
+            // Only the settings that changed since the previous packet are applied, streaming
+            // to the same target does not wait for the queued packets to be sent
+            struct esbRadioConfig_s config;
+            memcpy(config.address, command->address, 5);
+            config.channel = command->channel;
+            config.bitrate = (command->datarate == 1) ? radioBitrate1M : radioBitrate2M;
+            config.ack_enabled = (command->flags & NATIVE_SEND_ACK_ENABLED) != 0;
+            esb_set_radio_config(&config);
+            if ((command->arc & 0x0f) != current_arc) {
+                current_arc = command->arc & 0x0f;
+                esb_set_arc(current_arc);
+            }
+
+            memcpy(transaction->packet.data, command->payload, payload_length);
+            transaction->packet.length = payload_length;
+            transaction->invalid = false;
+        }
+    }
+
+    if (transaction->invalid) {
+        LOG_DBG("Invalid command type %d, length %d, seq %d", header->type, header->length, transaction->seq);
+    }
+
+    queue_transaction(transaction);
+}
+
+static void native_thread(void *, void *, void *)
+{
+    struct out_transfer *transfer;
+
+    while (1) {
+        k_msgq_get(&out_transfer_queue, &transfer, K_FOREVER);
+
+        uint32_t offset = 0;
+        while (offset + sizeof(struct native_command_header) <= transfer->length) {
+            const struct native_command_header *header = (const struct native_command_header *)&transfer->data[offset];
+
+            if (header->length < sizeof(struct native_command_header) || offset + header->length > transfer->length) {
+                // The rest of the transfer cannot be parsed
+                LOG_WRN("Malformed command at offset %d, dropping the end of the transfer", offset);
+                break;
+            }
+
+            handle_command(header);
+            offset += header->length;
+        }
+
+        out_transfer_release(transfer);
+    }
+}
+
+// Write the response of a transaction, returns its length
+static int write_response(struct transaction *transaction, uint8_t *buffer)
+{
+    struct native_response *response = (struct native_response *)buffer;
+    struct esbPacket_s *ack = &transaction->ack;
+
+    if (!transaction->respond) {
+        return 0;
+    }
+
+    response->status = 0;
+    response->seq = sys_cpu_to_le16(transaction->seq);
+    response->rssi = transaction->desc.rssi;
+    response->retry = transaction->desc.retry;
+    response->length = sizeof(struct native_response);
+
+    if (transaction->invalid) {
+        response->status |= NATIVE_STATUS_INVALID;
+        led_pulse_red(K_MSEC(50));
+    } else if (transaction->desc.acked) {
+        int ack_length = MIN(ack->length, NATIVE_MAX_ACK_LENGTH);
+        response->status |= NATIVE_STATUS_ACKED;
+        memcpy(response->data, ack->data, ack_length);
+        response->length += ack_length;
+        led_pulse_green(K_MSEC(50));
+    } else {
+        led_pulse_red(K_MSEC(50));
+    }
+
+    return response->length;
+}
+
+static void native_answer_thread(void *, void *, void *)
+{
+    static uint8_t buffer[USB_IN_BUFFER_SIZE];
+    struct transaction *transaction;
+
+    while (1) {
+        int length = 0;
+        k_timeout_t timeout = K_FOREVER;
+
+        // Coalesce the responses of all the transactions already done. While the IN buffers
+        // are all waiting for the host, the responses pile up and are sent together.
+        while (length + NATIVE_RESPONSE_MAX_LENGTH <= sizeof(buffer) &&
+               k_msgq_get(&transaction_done_queue, &transaction, timeout) == 0) {
+            length += write_response(transaction, &buffer[length]);
+            k_mem_slab_free(&transaction_slab, transaction);
+            timeout = K_NO_WAIT;
+        }
+
+        if (length > 0) {
+            usb_in_write(&usb_in, buffer, length, K_FOREVER);
+        }
+    }
+}
+
+#define NATIVE_THREAD_STACK_SIZE 1024
+#define NATIVE_THREAD_PRIORITY 5
+
+K_THREAD_DEFINE(native_tid, NATIVE_THREAD_STACK_SIZE,
+                native_thread, NULL, NULL, NULL,
+                NATIVE_THREAD_PRIORITY, 0, 0);
+
+K_THREAD_DEFINE(native_answer_tid, NATIVE_THREAD_STACK_SIZE,
+                native_answer_thread, NULL, NULL, NULL,
+                NATIVE_THREAD_PRIORITY, 0, 0);
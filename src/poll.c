@@ -0,0 +1,228 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "poll.h"
+
+#include "esb.h"
+#include "led.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(poll);
+
+// Null CRTP packet, used to poll the target when there is nothing to send
+#define NULL_PACKET 0xff
+
+// First polling interval after the target stopped sending data
+#define POLL_MIN_INTERVAL_US 250
+
+#define POLL_THREAD_STACK_SIZE 1024
+#define POLL_THREAD_PRIORITY 5
+
+struct uplink_packet {
+    uint8_t length;
+    uint8_t data[32];
+};
+
+struct downlink_packet {
+    uint8_t length;
+    uint8_t rssi;
+    uint8_t data[32];
+};
+
+K_MSGQ_DEFINE(uplink_queue, sizeof(struct uplink_packet), POLL_UPLINK_QUEUE_DEPTH, 1);
+K_MSGQ_DEFINE(downlink_queue, sizeof(struct downlink_packet), POLL_DOWNLINK_QUEUE_DEPTH, 1);
+
+static K_SEM_DEFINE(poll_run, 0, 1);
+static K_SEM_DEFINE(poll_stopped, 0, 1);
+
+static volatile bool running = false;
+static poll_downlink_cb_t downlink_cb = NULL;
+static uint32_t max_interval_us = POLL_DEFAULT_MAX_INTERVAL_MS * 1000;
+static atomic_t drop_count;
+
+void poll_set_max_interval(uint16_t max_interval_ms)
+{
+    max_interval_us = MAX(max_interval_ms * 1000, POLL_MIN_INTERVAL_US);
+}
+
+bool poll_send(const uint8_t *data, uint8_t length)
+{
+    struct uplink_packet uplink;
+
+    if (length < 1 || length > 32) {
+        return false;
+    }
+
+    uplink.length = length;
+    memcpy(uplink.data, data, length);
+
+    if (k_msgq_put(&uplink_queue, &uplink, K_NO_WAIT) != 0) {
+        atomic_inc(&drop_count);
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t poll_get_drop_count(void)
+{
+    return atomic_get(&drop_count);
+}
+
+static void poll_thread(void *, void *, void *)
+{
+    static struct esbPacket_s packet;
+    static struct esbPacket_s ack;
+    static struct uplink_packet uplink;
+    static struct downlink_packet downlink;
+
+    while (1) {
+        k_sem_take(&poll_run, K_FOREVER);
+
+        esb_set_ack_enabled(true);
+
+        bool has_uplink = false;
+        uint32_t interval_us = 0;
+
+        while (running) {
+            // Waiting on the uplink queue lets a new uplink packet cut the polling interval short
+            if (!has_uplink) {
+                k_timeout_t timeout = (interval_us == 0) ? K_NO_WAIT : K_USEC(interval_us);
+                has_uplink = (k_msgq_get(&uplink_queue, &uplink, timeout) == 0);
+            } else if (interval_us > 0) {
+                k_sleep(K_USEC(interval_us));
+            }
+
+            if (!running) {
+                break;
+            }
+
+            if (has_uplink) {
+                memcpy(packet.data, uplink.data, uplink.length);
+                packet.length = uplink.length;
+            } else {
+                packet.data[0] = NULL_PACKET;
+                packet.length = 1;
+            }
+
+            uint8_t rssi = 0;
+            uint8_t retry = 0;
+            bool acked = esb_send_packet(&packet, &ack, &rssi, &retry);
+            bool sent_uplink = acked && has_uplink;
+
+            if (acked) {
+                has_uplink = false;
+            }
+
+            if (acked && ack.length > 0) {
+                downlink.length = MIN(ack.length, 32);
+                downlink.rssi = rssi;
+                memcpy(downlink.data, ack.data, downlink.length);
+                if (k_msgq_put(&downlink_queue, &downlink, K_NO_WAIT) != 0) {
+                    atomic_inc(&drop_count);
+                }
+            }
+
+            if (sent_uplink || (acked && ack.length > 0) || k_msgq_num_used_get(&uplink_queue) > 0) {
+                // Data is flowing, poll again right away
+                interval_us = 0;
+            } else if (interval_us == 0) {
+                interval_us = POLL_MIN_INTERVAL_US;
+            } else {
+                interval_us = MIN(interval_us * 2, max_interval_us);
+            }
+        }
+
+        k_sem_give(&poll_stopped);
+    }
+}
+
+K_THREAD_DEFINE(poll_tid, POLL_THREAD_STACK_SIZE,
+                poll_thread, NULL, NULL, NULL,
+                POLL_THREAD_PRIORITY, 0, 0);
+
+// Sends the buffered ack payloads to the host, so that USB never stalls the polling
+static void poll_drain_thread(void *, void *, void *)
+{
+    static uint8_t buffer[POLL_RESULT_BUFFER_SIZE];
+    static struct downlink_packet downlink;
+    const int record_max_length = sizeof(struct pollDownlinkRecord_s) + sizeof(downlink.data);
+
+    while (1) {
+        int length = 0;
+        k_timeout_t timeout = K_FOREVER;
+
+        // Aggregate everything already buffered in one transfer
+        while (length + record_max_length <= POLL_RESULT_BUFFER_SIZE &&
+               k_msgq_get(&downlink_queue, &downlink, timeout) == 0) {
+            struct pollDownlinkRecord_s *record = (struct pollDownlinkRecord_s *)&buffer[length];
+            record->length = downlink.length;
+            record->rssi = downlink.rssi;
+            memcpy(&buffer[length + sizeof(struct pollDownlinkRecord_s)], downlink.data, downlink.length);
+            length += sizeof(struct pollDownlinkRecord_s) + downlink.length;
+            timeout = K_NO_WAIT;
+        }
+
+        poll_downlink_cb_t cb = downlink_cb;
+        if (running && cb) {
+            cb(buffer, length);
+            led_pulse_green(K_MSEC(50));
+        }
+    }
+}
+
+K_THREAD_DEFINE(poll_drain_tid, POLL_THREAD_STACK_SIZE,
+                poll_drain_thread, NULL, NULL, NULL,
+                POLL_THREAD_PRIORITY, 0, 0);
+
+void poll_start(poll_downlink_cb_t cb)
+{
+    if (running) {
+        return;
+    }
+
+    k_msgq_purge(&uplink_queue);
+    k_msgq_purge(&downlink_queue);
+    atomic_set(&drop_count, 0);
+    downlink_cb = cb;
+    running = true;
+    k_sem_give(&poll_run);
+}
+
+void poll_stop(void)
+{
+    if (!running) {
+        return;
+    }
+
+    running = false;
+    k_sem_take(&poll_stopped, K_FOREVER);
+    downlink_cb = NULL;
+    k_msgq_purge(&uplink_queue);
+    k_msgq_purge(&downlink_queue);
+}
@@ -0,0 +1,99 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @brief Size of the aggregated downlink transfers
+ */
+#define POLL_RESULT_BUFFER_SIZE 512
+
+/**
+ * @brief Number of ack payloads buffered in RAM while waiting for the host
+ */
+#define POLL_DOWNLINK_QUEUE_DEPTH 64
+
+/**
+ * @brief Number of uplink packets waiting to be sent
+ */
+#define POLL_UPLINK_QUEUE_DEPTH 8
+
+/**
+ * @brief Default maximum polling interval when the target has nothing to send
+ */
+#define POLL_DEFAULT_MAX_INTERVAL_MS 10
+
+/**
+ * @brief Downlink record, followed by the ack payload
+ */
+struct pollDownlinkRecord_s {
+    uint8_t length;     // Ack payload length
+    uint8_t rssi;       // Ack RSSI in inverted dBm
+} __attribute__((packed));
+
+/**
+ * @brief Callback called by the poll drain thread with aggregated downlink records
+ *
+ * @param data Buffer of pollDownlinkRecord_s records, each followed by its payload
+ * @param length Length of the buffer in bytes
+ */
+typedef void (*poll_downlink_cb_t)(const uint8_t *data, int length);
+
+/**
+ * @brief Set the maximum polling interval
+ *
+ * The target is polled back to back as long as it answers with ack payloads. When it
+ * answers with empty acks, or does not answer, the interval doubles up to this value.
+ *
+ * @param max_interval_ms Maximum polling interval in milliseconds
+ */
+void poll_set_max_interval(uint16_t max_interval_ms);
+
+/**
+ * @brief Queue a packet to be sent to the target in place of a null packet
+ *
+ * The packet is retried until it is acked.
+ *
+ * @param data Payload
+ * @param length Payload length, from 1 to 32
+ * @return true if the packet has been queued, false if the queue is full or the length invalid
+ */
+bool poll_send(const uint8_t *data, uint8_t length);
+
+/**
+ * @brief Get the number of ack payloads and uplink packets dropped because a queue was full
+ */
+uint32_t poll_get_drop_count(void);
+
+/**
+ * @brief Start polling the target set with the current PTX radio settings
+ * @param cb Callback called from the drain thread with the received ack payloads
+ */
+void poll_start(poll_downlink_cb_t cb);
+
+/**
+ * @brief Stop polling, returns when the current packet is done
+ */
+void poll_stop(void);
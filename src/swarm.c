@@ -0,0 +1,288 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "swarm.h"
+
+#include "esb.h"
+#include "led.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(swarm);
+
+// Null CRTP packet, used to poll targets that have nothing to receive
+#define NULL_PACKET 0xff
+
+#define SWARM_THREAD_STACK_SIZE 1024
+#define SWARM_THREAD_PRIORITY 5
+
+static K_MUTEX_DEFINE(targets_lock);
+static K_SEM_DEFINE(swarm_run, 0, 1);
+static K_SEM_DEFINE(swarm_stopped, 0, 1);
+
+static struct {
+    bool enabled;
+    uint8_t address[5];
+    uint8_t channel;
+    esbBitrate_t bitrate;
+    uint8_t arc;
+    // Pending uplink payload, payload_seq is incremented each time it is replaced
+    bool has_payload;
+    uint32_t payload_seq;
+    uint8_t payload_length;
+    uint8_t payload[32];
+} targets[SWARM_MAX_TARGETS];
+
+static volatile bool running = false;
+static swarm_result_cb_t result_cb = NULL;
+static uint16_t period_ms = 0;
+static uint8_t cycle = 0;
+
+static uint8_t result_buffer[SWARM_RESULT_BUFFER_SIZE];
+static int result_length;
+
+bool swarm_set_target(int index, const uint8_t address[5], uint8_t channel, esbBitrate_t bitrate, uint8_t arc)
+{
+    if (index < 0 || index >= SWARM_MAX_TARGETS || channel > 100) {
+        return false;
+    }
+
+    k_mutex_lock(&targets_lock, K_FOREVER);
+    memcpy(targets[index].address, address, 5);
+    targets[index].channel = channel;
+    targets[index].bitrate = bitrate;
+    targets[index].arc = arc & 0x0f;
+    targets[index].has_payload = false;
+    targets[index].enabled = true;
+    k_mutex_unlock(&targets_lock);
+
+    return true;
+}
+
+void swarm_remove_target(int index)
+{
+    if (index < 0 || index >= SWARM_MAX_TARGETS) {
+        return;
+    }
+
+    k_mutex_lock(&targets_lock, K_FOREVER);
+    targets[index].enabled = false;
+    k_mutex_unlock(&targets_lock);
+}
+
+void swarm_clear_targets(void)
+{
+    k_mutex_lock(&targets_lock, K_FOREVER);
+    for (int i = 0; i < SWARM_MAX_TARGETS; i++) {
+        targets[i].enabled = false;
+    }
+    k_mutex_unlock(&targets_lock);
+}
+
+bool swarm_set_payload(int index, const uint8_t *data, uint8_t length)
+{
+    if (index < 0 || index >= SWARM_MAX_TARGETS || length < 1 || length > 32) {
+        return false;
+    }
+
+    bool set = false;
+
+    k_mutex_lock(&targets_lock, K_FOREVER);
+    if (targets[index].enabled) {
+        memcpy(targets[index].payload, data, length);
+        targets[index].payload_length = length;
+        targets[index].payload_seq += 1;
+        targets[index].has_payload = true;
+        set = true;
+    }
+    k_mutex_unlock(&targets_lock);
+
+    return set;
+}
+
+void swarm_set_period(uint16_t period)
+{
+    period_ms = period;
+}
+
+static void result_reset(void)
+{
+    struct swarmResultHeader_s *header = (struct swarmResultHeader_s *)result_buffer;
+    header->cycle = cycle;
+    header->flags = 0;
+    result_length = sizeof(struct swarmResultHeader_s);
+}
+
+static void result_flush(bool end_of_cycle)
+{
+    struct swarmResultHeader_s *header = (struct swarmResultHeader_s *)result_buffer;
+
+    if (end_of_cycle) {
+        header->flags |= SWARM_RESULT_FLAG_END_OF_CYCLE;
+    }
+
+    if (result_cb) {
+        result_cb(result_buffer, result_length);
+    }
+
+    result_reset();
+}
+
+static void result_append(uint8_t index, bool acked, uint8_t rssi, uint8_t retry, struct esbPacket_s *ack)
+{
+    uint8_t ack_length = acked ? MIN(ack->length, 32) : 0;
+    int record_length = sizeof(struct swarmResultRecord_s) + ack_length;
+
+    if (result_length + record_length > SWARM_RESULT_BUFFER_SIZE) {
+        result_flush(false);
+    }
+
+    struct swarmResultRecord_s *record = (struct swarmResultRecord_s *)&result_buffer[result_length];
+    record->index = index;
+    record->status = (retry & 0x0f) << 4 | (rssi < 64) << 1 | (acked ? 1 : 0);
+    record->rssi = rssi;
+    record->length = ack_length;
+    memcpy(&result_buffer[result_length + sizeof(struct swarmResultRecord_s)], ack->data, ack_length);
+
+    result_length += record_length;
+}
+
+// Poll all enabled targets once, returns the number of targets polled
+static int run_cycle(void)
+{
+    static struct esbPacket_s packet;
+    static struct esbPacket_s ack;
+    int polled = 0;
+
+    result_reset();
+
+    for (int i = 0; i < SWARM_MAX_TARGETS && running; i++) {
+        // The target is copied so that the radio is configured without holding the lock
+        struct esbRadioConfig_s config = { .ack_enabled = true };
+
+        k_mutex_lock(&targets_lock, K_FOREVER);
+        if (!targets[i].enabled) {
+            k_mutex_unlock(&targets_lock);
+            continue;
+        }
+
+        memcpy(config.address, targets[i].address, 5);
+        config.channel = targets[i].channel;
+        config.bitrate = targets[i].bitrate;
+        uint8_t target_arc = targets[i].arc;
+
+        bool has_payload = targets[i].has_payload;
+        uint32_t payload_seq = targets[i].payload_seq;
+        if (has_payload) {
+            memcpy(packet.data, targets[i].payload, targets[i].payload_length);
+            packet.length = targets[i].payload_length;
+        } else {
+            packet.data[0] = NULL_PACKET;
+            packet.length = 1;
+        }
+        k_mutex_unlock(&targets_lock);
+
+        esb_set_radio_config(&config);
+        esb_set_arc(target_arc);
+
+        uint8_t rssi = 0;
+        uint8_t retry = 0;
+        bool acked = esb_send_packet(&packet, &ack, &rssi, &retry);
+
+        if (acked && has_payload) {
+            // Only consume the payload if it has not been replaced in the meantime
+            k_mutex_lock(&targets_lock, K_FOREVER);
+            if (targets[i].payload_seq == payload_seq) {
+                targets[i].has_payload = false;
+            }
+            k_mutex_unlock(&targets_lock);
+        }
+
+        result_append(i, acked, rssi, retry, &ack);
+        polled += 1;
+    }
+
+    if (polled > 0) {
+        result_flush(true);
+        led_pulse_green(K_MSEC(50));
+    }
+
+    return polled;
+}
+
+static void swarm_thread(void *, void *, void *)
+{
+    while (1) {
+        k_sem_take(&swarm_run, K_FOREVER);
+
+        esb_set_ack_enabled(true);
+
+        while (running) {
+            int64_t cycle_start = k_uptime_get();
+
+            if (run_cycle() == 0) {
+                // Nothing to poll, do not spin
+                k_sleep(K_MSEC(10));
+                continue;
+            }
+
+            cycle += 1;
+
+            while (running && (k_uptime_get() - cycle_start) < period_ms) {
+                k_sleep(K_MSEC(1));
+            }
+        }
+
+        k_sem_give(&swarm_stopped);
+    }
+}
+
+K_THREAD_DEFINE(swarm_tid, SWARM_THREAD_STACK_SIZE,
+                swarm_thread, NULL, NULL, NULL,
+                SWARM_THREAD_PRIORITY, 0, 0);
+
+void swarm_start(swarm_result_cb_t cb)
+{
+    if (running) {
+        return;
+    }
+
+    result_cb = cb;
+    cycle = 0;
+    running = true;
+    k_sem_give(&swarm_run);
+}
+
+void swarm_stop(void)
+{
+    if (!running) {
+        return;
+    }
+
+    running = false;
+    k_sem_take(&swarm_stopped, K_FOREVER);
+    result_cb = NULL;
+}
@@ -0,0 +1,121 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esb.h"
+
+/**
+ * @brief Maximum number of targets polled by the swarm engine
+ */
+#define SWARM_MAX_TARGETS 64
+
+/**
+ * @brief Size of the aggregated result buffers
+ */
+#define SWARM_RESULT_BUFFER_SIZE 512
+
+/**
+ * @brief Result buffer header
+ *
+ * Each result buffer starts with this header followed by one record per polled target.
+ */
+struct swarmResultHeader_s {
+    uint8_t cycle;      // Cycle counter, wraps at 256
+    uint8_t flags;      // SWARM_RESULT_FLAG_*
+} __attribute__((packed));
+
+// Last buffer of a cycle
+#define SWARM_RESULT_FLAG_END_OF_CYCLE 0x01
+
+/**
+ * @brief Result record, followed by the ack payload
+ */
+struct swarmResultRecord_s {
+    uint8_t index;      // Target index
+    uint8_t status;     // Same as the Crazyradio PA status byte: bit 0 acked, bit 1 power detector, bits 4-7 retries
+    uint8_t rssi;       // Ack RSSI in inverted dBm, only valid if acked
+    uint8_t length;     // Ack payload length
+} __attribute__((packed));
+
+/**
+ * @brief Callback called by the swarm thread with an aggregated result buffer
+ *
+ * @param data Result buffer, starting with a swarmResultHeader_s
+ * @param length Length of the buffer in bytes
+ */
+typedef void (*swarm_result_cb_t)(const uint8_t *data, int length);
+
+/**
+ * @brief Set, or replace, a target
+ *
+ * @param index Target index, from 0 to SWARM_MAX_TARGETS-1
+ * @param address Target radio address
+ * @param channel Target radio channel, from 0 to 100
+ * @param bitrate Target radio bitrate
+ * @param arc Number of retries for the target
+ * @return true if the target has been set, false if a parameter is invalid
+ */
+bool swarm_set_target(int index, const uint8_t address[5], uint8_t channel, esbBitrate_t bitrate, uint8_t arc);
+
+/**
+ * @brief Remove a target from the polling cycle
+ * @param index Target index
+ */
+void swarm_remove_target(int index);
+
+/**
+ * @brief Remove all targets
+ */
+void swarm_clear_targets(void);
+
+/**
+ * @brief Set the next payload to send to a target
+ *
+ * The payload is sent in place of a null packet until it has been acked.
+ *
+ * @param index Target index
+ * @param data Payload
+ * @param length Payload length, from 1 to 32
+ * @return true if the payload has been set, false if the target is invalid
+ */
+bool swarm_set_payload(int index, const uint8_t *data, uint8_t length);
+
+/**
+ * @brief Set the minimum duration of a polling cycle
+ * @param period_ms Minimum cycle period in milliseconds, 0 to poll as fast as possible
+ */
+void swarm_set_period(uint16_t period_ms);
+
+/**
+ * @brief Start polling the targets
+ * @param cb Callback called from the swarm thread with the aggregated results
+ */
+void swarm_start(swarm_result_cb_t cb);
+
+/**
+ * @brief Stop polling, returns when the current cycle is done
+ */
+void swarm_stop(void);
@@ -0,0 +1,97 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "usb_in.h"
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/usb/usb_device.h>
+
+static void usb_in_done(uint8_t ep, int size, void *priv);
+
+// Start transferring the next queued buffer if the endpoint is idle
+static void usb_in_start(struct usbInEndpoint_s *endpoint)
+{
+    k_mutex_lock(endpoint->mutex, K_FOREVER);
+    while (endpoint->active == NULL && k_msgq_get(endpoint->queue, &endpoint->active, K_NO_WAIT) == 0) {
+        if (endpoint->active->generation != endpoint->generation) {
+            // Written before the transfers were cancelled
+            k_mem_slab_free(endpoint->slab, endpoint->active);
+            endpoint->active = NULL;
+            continue;
+        }
+        // A ZLP is added by the transfer when the length is a multiple of the max packet size
+        if (usb_transfer(endpoint->ep, endpoint->active->data, endpoint->active->length,
+                         USB_TRANS_WRITE, usb_in_done, endpoint->active) != 0) {
+            // Not configured, the data is dropped
+            k_mem_slab_free(endpoint->slab, endpoint->active);
+            endpoint->active = NULL;
+        }
+    }
+    k_mutex_unlock(endpoint->mutex);
+}
+
+// Transfer completion, called from the USB work queue. Every transfer started gets exactly
+// one, also when it is cancelled, and only one transfer runs at a time: the buffer is the
+// active one and is only released here.
+static void usb_in_done(uint8_t ep, int size, void *priv)
+{
+    struct usbInBuffer_s *buffer = priv;
+    struct usbInEndpoint_s *endpoint = buffer->endpoint;
+
+    k_mutex_lock(endpoint->mutex, K_FOREVER);
+    k_mem_slab_free(endpoint->slab, buffer);
+    endpoint->active = NULL;
+    k_mutex_unlock(endpoint->mutex);
+
+    usb_in_start(endpoint);
+}
+
+void usb_in_cancelled(struct usbInEndpoint_s *endpoint)
+{
+    // The active transfer is left to its completion callback, that starts the next one
+    k_mutex_lock(endpoint->mutex, K_FOREVER);
+    endpoint->generation++;
+    k_mutex_unlock(endpoint->mutex);
+}
+
+bool usb_in_write(struct usbInEndpoint_s *endpoint, const void *data, int length, k_timeout_t timeout)
+{
+    struct usbInBuffer_s *buffer;
+
+    if (length > USB_IN_BUFFER_SIZE ||
+        k_mem_slab_alloc(endpoint->slab, (void **)&buffer, timeout) != 0) {
+        return false;
+    }
+
+    buffer->endpoint = endpoint;
+    buffer->generation = endpoint->generation;
+    memcpy(buffer->data, data, length);
+    buffer->length = length;
+    // Cannot fail: the queue can hold all the buffers
+    k_msgq_put(endpoint->queue, &buffer, K_NO_WAIT);
+    usb_in_start(endpoint);
+
+    return true;
+}
@@ -0,0 +1,106 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * Copyright 2026 Bitcraze AB
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <zephyr/kernel.h>
+
+/**
+ * @brief Largest transfer that can be sent at once on an IN endpoint
+ */
+#define USB_IN_BUFFER_SIZE 512
+
+struct usbInEndpoint_s;
+
+/**
+ * @brief IN transfer buffer, owned by its endpoint pool
+ */
+struct usbInBuffer_s {
+    struct usbInEndpoint_s *endpoint;
+    // Endpoint generation when the data was written
+    uint32_t generation;
+    int length;
+    uint8_t data[USB_IN_BUFFER_SIZE];
+};
+
+/**
+ * @brief Bulk IN endpoint sending data asynchronously, in order, from a pool of buffers
+ *
+ * Defined with USB_IN_ENDPOINT_DEFINE(). The fields are private.
+ */
+struct usbInEndpoint_s {
+    uint8_t ep;
+    struct k_mem_slab *slab;
+    struct k_msgq *queue;
+    struct k_mutex *mutex;
+    // Buffer being transferred, NULL when the endpoint is idle
+    struct usbInBuffer_s *active;
+    // Incremented when the transfers are cancelled, the data queued before is not sent
+    uint32_t generation;
+};
+
+/**
+ * @brief Define an IN endpoint and its pool of buffers
+ *
+ * @param name Name of the endpoint variable
+ * @param ep_addr USB endpoint address
+ * @param buffer_count Number of buffers, queued or being transferred
+ */
+#define USB_IN_ENDPOINT_DEFINE(name, ep_addr, buffer_count)                                 \
+    K_MEM_SLAB_DEFINE_STATIC(name##_slab, sizeof(struct usbInBuffer_s), buffer_count, 4);   \
+    K_MSGQ_DEFINE(name##_queue, sizeof(struct usbInBuffer_s *), buffer_count, 4);           \
+    K_MUTEX_DEFINE(name##_mutex);                                                           \
+    static struct usbInEndpoint_s name = {                                                  \
+        .ep = ep_addr,                                                                      \
+        .slab = &name##_slab,                                                               \
+        .queue = &name##_queue,                                                             \
+        .mutex = &name##_mutex,                                                             \
+    }
+
+/**
+ * @brief Queue data to be sent on an IN endpoint, after the data already queued
+ *
+ * The data is copied, the call returns as soon as it is queued. A transfer that is a multiple
+ * of the max packet size is terminated by a ZLP.
+ *
+ * @param endpoint IN endpoint
+ * @param data Data to send
+ * @param length Length of the data, at most USB_IN_BUFFER_SIZE
+ * @param timeout Time to wait for a buffer to be free
+ * @return true if the data has been queued, false if no buffer got free within the timeout
+ */
+bool usb_in_write(struct usbInEndpoint_s *endpoint, const void *data, int length, k_timeout_t timeout);
+
+/**
+ * @brief Drop the data queued before the USB stack cancelled the transfers
+ *
+ * To be called when the device is reset or disconnected. The transfer in progress still gets
+ * its completion callback from the USB stack, its buffer is released then, and the next
+ * transfer is only started after it. The data queued so far is dropped instead of being sent
+ * to the next host session.
+ *
+ * @param endpoint IN endpoint
+ */
+void usb_in_cancelled(struct usbInEndpoint_s *endpoint);